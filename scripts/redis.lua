@@ -0,0 +1,10 @@
+-- example script that benchmarks Redis, run with a tcp:// URL like
+-- wrk -s scripts/redis.lua tcp://127.0.0.1:6379
+
+wrk.framing = "resp"
+
+local command = "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$5\r\nvalue\r\n"
+
+request = function()
+   return command
+end
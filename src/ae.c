@@ -44,22 +44,133 @@
 #include "zmalloc.h"
 #include "config.h"
 
+/* File descriptors are shared by every loop in the process, but a loop only
+ * sees its own. Each fd registered with a loop gets a dense slot, and the per
+ * fd state of the loop and of the polling API is indexed by slot, so it grows
+ * with the loop's own fds rather than with the highest fd in the process. */
+static int aeSlotOf(aeEventLoop *eventLoop, int fd) {
+    if (fd < 0 || fd >= eventLoop->fdsize) return -1;
+    return eventLoop->slots[fd];
+}
+
+/* Return the slot of the fd, handing out a new one if it has none. */
+static int aeSlotGet(aeEventLoop *eventLoop, int fd) {
+    aeFileEvent *fe;
+    int slot;
+
+    if (fd < 0) return -1;
+    if (fd >= eventLoop->fdsize) {
+        int size = eventLoop->fdsize ? eventLoop->fdsize : 64, j;
+        int *slots;
+
+        while (size <= fd) size *= 2;
+        if ((slots = zrealloc(eventLoop->slots, sizeof(int)*size)) == NULL)
+            return -1;
+        for (j = eventLoop->fdsize; j < size; j++) slots[j] = -1;
+        eventLoop->slots = slots;
+        eventLoop->fdsize = size;
+    }
+    if ((slot = eventLoop->slots[fd]) != -1) return slot;
+
+    if (eventLoop->freeSlot == -1 &&
+        eventLoop->slotCount == eventLoop->setsize &&
+        aeResizeSetSize(eventLoop, eventLoop->setsize*2) == AE_ERR)
+        return -1;
+    if ((slot = eventLoop->freeSlot) != -1) {
+        eventLoop->freeSlot = eventLoop->events[slot].next;
+    } else {
+        slot = eventLoop->slotCount++;
+    }
+    fe = &eventLoop->events[slot];
+    fe->mask = AE_NONE;
+    fe->fd = fd;
+    fe->held = 0;
+    eventLoop->slots[fd] = slot;
+    return slot;
+}
+
+/* Give the slot back once neither the loop nor the polling API uses it. */
+static void aeSlotPut(aeEventLoop *eventLoop, int fd) {
+    int slot = aeSlotOf(eventLoop, fd);
+    aeFileEvent *fe;
+
+    if (slot == -1) return;
+    fe = &eventLoop->events[slot];
+    if (fe->mask != AE_NONE || fe->held) return;
+    eventLoop->slots[fd] = -1;
+    fe->fd = -1;
+    fe->next = eventLoop->freeSlot;
+    eventLoop->freeSlot = slot;
+}
+
 /* Include the best multiplexing layer supported by this system.
  * The following should be ordered by performances, descending. */
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
-    #ifdef HAVE_EPOLL
-    #include "ae_epoll.c"
+    #ifdef HAVE_IOURING
+    #include "ae_iouring.c"
     #else
-        #ifdef HAVE_KQUEUE
-        #include "ae_kqueue.c"
+        #ifdef HAVE_EPOLL
+        #include "ae_epoll.c"
         #else
-        #include "ae_select.c"
+            #ifdef HAVE_KQUEUE
+            #include "ae_kqueue.c"
+            #else
+            #include "ae_select.c"
+            #endif
         #endif
     #endif
 #endif
 
+/* Only the io_uring module does completion based socket I/O, with any other
+ * module sockets are never attached and are read and written directly. */
+#ifndef AE_HAVE_RING
+static int aeApiRingCreate(aeEventLoop *eventLoop, int count, int size) {
+    AE_NOTUSED(eventLoop); AE_NOTUSED(count); AE_NOTUSED(size);
+    return -1;
+}
+
+static int aeApiRingAttach(aeEventLoop *eventLoop, int fd, int flags) {
+    AE_NOTUSED(eventLoop); AE_NOTUSED(fd); AE_NOTUSED(flags);
+    return -1;
+}
+
+static void aeApiRingDetach(aeEventLoop *eventLoop, int fd) {
+    AE_NOTUSED(eventLoop); AE_NOTUSED(fd);
+}
+
+static void aeApiRingRelease(aeEventLoop *eventLoop, int fd) {
+    AE_NOTUSED(eventLoop); AE_NOTUSED(fd);
+}
+
+static ssize_t aeApiRingRead(aeEventLoop *eventLoop, int fd, char **buf,
+        size_t max)
+{
+    AE_NOTUSED(eventLoop); AE_NOTUSED(fd); AE_NOTUSED(buf); AE_NOTUSED(max);
+    errno = EBADF;
+    return -1;
+}
+
+static size_t aeApiRingPending(aeEventLoop *eventLoop, int fd) {
+    AE_NOTUSED(eventLoop); AE_NOTUSED(fd);
+    return 0;
+}
+
+static ssize_t aeApiRingWrite(aeEventLoop *eventLoop, int fd,
+        const struct iovec *iov, int iovcnt)
+{
+    AE_NOTUSED(eventLoop); AE_NOTUSED(fd); AE_NOTUSED(iov); AE_NOTUSED(iovcnt);
+    errno = EBADF;
+    return -1;
+}
+
+static int aeApiRingWriting(aeEventLoop *eventLoop, int fd) {
+    AE_NOTUSED(eventLoop); AE_NOTUSED(fd);
+    return 0;
+}
+#endif
+
 aeEventLoop *aeCreateEventLoop(int setsize) {
     aeEventLoop *eventLoop;
     int i;
@@ -70,7 +181,17 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
     eventLoop->setsize = setsize;
     eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
+    eventLoop->slots = NULL;
+    eventLoop->fdsize = 0;
+    eventLoop->slotCount = 0;
+    eventLoop->freeSlot = -1;
+    eventLoop->timeEvents = NULL;
+    eventLoop->timeEventCount = 0;
+    eventLoop->timeEventSize = 0;
+    eventLoop->timeEventFree = NULL;
+    eventLoop->timeEventSlots = NULL;
+    eventLoop->timeEventSlotCount = 0;
+    eventLoop->timeEventSlotSize = 0;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
@@ -92,12 +213,65 @@ err:
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    int j;
+
     aeApiFree(eventLoop);
+    for (j = 0; j < eventLoop->timeEventSlotCount; j++)
+        zfree(eventLoop->timeEventSlots[j]);
+    zfree(eventLoop->timeEventSlots);
+    zfree(eventLoop->timeEvents);
+    zfree(eventLoop->slots);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
     zfree(eventLoop);
 }
 
+/* Return the bytes allocated for the loop and its polling API. Memory
+ * held by the kernel is not included. */
+size_t aeGetMemoryUsage(aeEventLoop *eventLoop) {
+    return sizeof(*eventLoop) +
+        (size_t)eventLoop->setsize*(sizeof(aeFileEvent)+sizeof(aeFiredEvent)) +
+        (size_t)eventLoop->fdsize*sizeof(int) +
+        (size_t)eventLoop->timeEventSize*sizeof(aeTimeEvent *) +
+        (size_t)eventLoop->timeEventSlotSize*sizeof(aeTimeEvent *) +
+        (size_t)eventLoop->timeEventSlotCount*sizeof(aeTimeEvent) +
+        aeApiMemory(eventLoop);
+}
+
+/* Return the current set size. */
+int aeGetSetSize(aeEventLoop *eventLoop) {
+    return eventLoop->setsize;
+}
+
+/* Resize the maximum set size of the event loop, the number of slots.
+ * If the requested set size is smaller than the number of slots already
+ * handed out, AE_ERR is returned and the operation is not performed at all.
+ *
+ * Otherwise AE_OK is returned and the operation is successful. */
+int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
+    aeFileEvent *events;
+    aeFiredEvent *fired;
+    int i;
+
+    if (setsize == eventLoop->setsize) return AE_OK;
+    if (eventLoop->slotCount > setsize) return AE_ERR;
+    if (aeApiResize(eventLoop,setsize) == -1) return AE_ERR;
+
+    events = zrealloc(eventLoop->events,sizeof(aeFileEvent)*setsize);
+    if (events == NULL) return AE_ERR;
+    eventLoop->events = events;
+    fired = zrealloc(eventLoop->fired,sizeof(aeFiredEvent)*setsize);
+    if (fired == NULL) return AE_ERR;
+    eventLoop->fired = fired;
+
+    /* Make sure that if we created new slots, they are initialized with
+     * an AE_NONE mask. */
+    for (i = eventLoop->slotCount; i < setsize; i++)
+        eventLoop->events[i].mask = AE_NONE;
+    eventLoop->setsize = setsize;
+    return AE_OK;
+}
+
 void aeStop(aeEventLoop *eventLoop) {
     eventLoop->stop = 1;
 }
@@ -105,14 +279,21 @@ void aeStop(aeEventLoop *eventLoop) {
 int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
         aeFileProc *proc, void *clientData)
 {
-    if (fd >= eventLoop->setsize) {
+    int slot = aeSlotGet(eventLoop, fd);
+
+    if (slot == -1) {
         errno = ERANGE;
         return AE_ERR;
     }
-    aeFileEvent *fe = &eventLoop->events[fd];
+    aeFileEvent *fe = &eventLoop->events[slot];
 
-    if (aeApiAddEvent(eventLoop, fd, mask) == -1)
+    /* Only call into the polling API if the interest set changes, so that
+     * replacing the handler of a registered event costs no syscall. */
+    if ((fe->mask & mask) != mask &&
+        aeApiAddEvent(eventLoop, fd, mask) == -1) {
+        aeSlotPut(eventLoop, fd);
         return AE_ERR;
+    }
     fe->mask |= mask;
     if (mask & AE_READABLE) fe->rfileProc = proc;
     if (mask & AE_WRITABLE) fe->wfileProc = proc;
@@ -124,124 +305,251 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
 
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
 {
-    if (fd >= eventLoop->setsize) return;
-    aeFileEvent *fe = &eventLoop->events[fd];
+    int slot = aeSlotOf(eventLoop, fd);
 
-    if (fe->mask == AE_NONE) return;
+    if (slot == -1) return;
+    aeFileEvent *fe = &eventLoop->events[slot];
+
+    mask &= fe->mask;
+    if (mask == AE_NONE) return;
     fe->mask = fe->mask & (~mask);
     if (fd == eventLoop->maxfd && fe->mask == AE_NONE) {
         /* Update the max fd */
-        int j;
+        int j, maxfd = -1;
 
-        for (j = eventLoop->maxfd-1; j >= 0; j--)
-            if (eventLoop->events[j].mask != AE_NONE) break;
-        eventLoop->maxfd = j;
+        for (j = 0; j < eventLoop->slotCount; j++)
+            if (eventLoop->events[j].mask != AE_NONE &&
+                eventLoop->events[j].fd > maxfd)
+                maxfd = eventLoop->events[j].fd;
+        eventLoop->maxfd = maxfd;
     }
     aeApiDelEvent(eventLoop, fd, mask);
+    aeSlotPut(eventLoop, fd);
+}
+
+/* Set up count receive buffers of size bytes for attached sockets. Returns
+ * AE_ERR when the multiplexing layer cannot do completion based I/O. */
+int aeRingCreate(aeEventLoop *eventLoop, int count, int size) {
+    return aeApiRingCreate(eventLoop, count, size) == -1 ? AE_ERR : AE_OK;
+}
+
+/* Hand a connected socket to the kernel for receiving and sending. From
+ * then on it must only be read and written with aeRingRead() and
+ * aeRingWrite(), and detached with aeRingDetach() before it is closed.
+ * flags is AE_RING_COPY or 0. */
+int aeRingAttach(aeEventLoop *eventLoop, int fd, int flags) {
+    return aeApiRingAttach(eventLoop, fd, flags) == -1 ? AE_ERR : AE_OK;
+}
+
+void aeRingDetach(aeEventLoop *eventLoop, int fd) {
+    aeApiRingDetach(eventLoop, fd);
+}
+
+/* Go back to readiness: the data received so far can still be read, after
+ * that reads and writes fail with EBADF and the socket is used directly. */
+void aeRingRelease(aeEventLoop *eventLoop, int fd) {
+    aeApiRingRelease(eventLoop, fd);
+}
+
+/* Return up to max received bytes in *buf, which stays valid until the next
+ * read or poll on this loop. 0 means EOF, -1 sets errno as read(2) does. */
+ssize_t aeRingRead(aeEventLoop *eventLoop, int fd, char **buf, size_t max) {
+    return aeApiRingRead(eventLoop, fd, buf, max);
+}
+
+size_t aeRingPending(aeEventLoop *eventLoop, int fd) {
+    return aeApiRingPending(eventLoop, fd);
+}
+
+/* Queue the data to be sent and return its length. Unless the socket was
+ * attached with AE_RING_COPY the kernel reads the caller's buffers in place,
+ * so they must not change until aeRingWriting() returns 0. Fails with
+ * EAGAIN while an earlier write is still in flight. */
+ssize_t aeRingWrite(aeEventLoop *eventLoop, int fd, const struct iovec *iov,
+        int iovcnt)
+{
+    return aeApiRingWrite(eventLoop, fd, iov, iovcnt);
+}
+
+int aeRingWriting(aeEventLoop *eventLoop, int fd) {
+    return aeApiRingWriting(eventLoop, fd);
 }
 
 int aeGetFileEvents(aeEventLoop *eventLoop, int fd) {
-    if (fd >= eventLoop->setsize) return 0;
-    aeFileEvent *fe = &eventLoop->events[fd];
+    int slot = aeSlotOf(eventLoop, fd);
 
-    return fe->mask;
+    if (slot == -1) return 0;
+    return eventLoop->events[slot].mask;
 }
 
-static void aeGetTime(long *seconds, long *milliseconds)
+static long long aeGetTime(void)
 {
     struct timeval tv;
 
     gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec/1000;
+    return ((long long)tv.tv_sec)*1000 + tv.tv_usec/1000;
+}
+
+/* Time events are kept in a binary min-heap ordered by their expiry time,
+ * so finding the nearest timer is O(1) and insertion, expiry or deletion
+ * O(log(N)). Released events are kept in a free list and reused by later
+ * timers. Every node keeps its slot in timeEventSlots for good, and the low
+ * bits of an id hold that slot so aeDeleteTimeEvent() finds it directly,
+ * while the high bits count up so ids still grow. */
+#define AE_TIME_SLOT_BITS 24
+#define AE_TIME_SLOT_MASK ((1LL<<AE_TIME_SLOT_BITS)-1)
+
+static void aeTimeEventSwap(aeEventLoop *eventLoop, int a, int b) {
+    aeTimeEvent *te = eventLoop->timeEvents[a];
+    eventLoop->timeEvents[a] = eventLoop->timeEvents[b];
+    eventLoop->timeEvents[b] = te;
+    eventLoop->timeEvents[a]->index = a;
+    eventLoop->timeEvents[b]->index = b;
+}
+
+static void aeTimeEventSiftUp(aeEventLoop *eventLoop, int j) {
+    aeTimeEvent **heap = eventLoop->timeEvents;
+
+    while (j > 0) {
+        int parent = (j-1)/2;
+        if (heap[parent]->when <= heap[j]->when) break;
+        aeTimeEventSwap(eventLoop, parent, j);
+        j = parent;
+    }
+}
+
+static void aeTimeEventSiftDown(aeEventLoop *eventLoop, int j) {
+    aeTimeEvent **heap = eventLoop->timeEvents;
+    int count = eventLoop->timeEventCount;
+
+    while (1) {
+        int left = j*2+1, right = left+1, min = j;
+
+        if (left < count && heap[left]->when < heap[min]->when) min = left;
+        if (right < count && heap[right]->when < heap[min]->when) min = right;
+        if (min == j) break;
+        aeTimeEventSwap(eventLoop, min, j);
+        j = min;
+    }
+}
+
+static int aeTimeEventPush(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (eventLoop->timeEventCount == eventLoop->timeEventSize) {
+        int size = eventLoop->timeEventSize ? eventLoop->timeEventSize*2 : 16;
+        aeTimeEvent **heap = zrealloc(eventLoop->timeEvents, sizeof(*heap)*size);
+
+        if (heap == NULL) return AE_ERR;
+        eventLoop->timeEvents = heap;
+        eventLoop->timeEventSize = size;
+    }
+    te->index = eventLoop->timeEventCount;
+    eventLoop->timeEvents[eventLoop->timeEventCount] = te;
+    aeTimeEventSiftUp(eventLoop, eventLoop->timeEventCount++);
+    return AE_OK;
 }
 
-static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
-    long cur_sec, cur_ms, when_sec, when_ms;
+static aeTimeEvent *aeTimeEventRemove(aeEventLoop *eventLoop, int j) {
+    aeTimeEvent *te = eventLoop->timeEvents[j];
+    int last = --eventLoop->timeEventCount;
 
-    aeGetTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds/1000;
-    when_ms = cur_ms + milliseconds%1000;
-    if (when_ms >= 1000) {
-        when_sec ++;
-        when_ms -= 1000;
+    if (j != last) {
+        eventLoop->timeEvents[j] = eventLoop->timeEvents[last];
+        eventLoop->timeEvents[j]->index = j;
+        aeTimeEventSiftDown(eventLoop, j);
+        aeTimeEventSiftUp(eventLoop, j);
     }
-    *sec = when_sec;
-    *ms = when_ms;
+    te->index = -1;
+    return te;
+}
+
+static aeTimeEvent *aeTimeEventAlloc(aeEventLoop *eventLoop) {
+    int slot = eventLoop->timeEventSlotCount;
+    aeTimeEvent *te;
+
+    if ((te = eventLoop->timeEventFree) != NULL) {
+        eventLoop->timeEventFree = te->next;
+        return te;
+    }
+    if (slot > AE_TIME_SLOT_MASK) return NULL;
+    if (slot == eventLoop->timeEventSlotSize) {
+        int size = slot ? slot*2 : 16;
+        aeTimeEvent **slots = zrealloc(eventLoop->timeEventSlots, sizeof(*slots)*size);
+
+        if (slots == NULL) return NULL;
+        eventLoop->timeEventSlots = slots;
+        eventLoop->timeEventSlotSize = size;
+    }
+    if ((te = zmalloc(sizeof(*te))) == NULL) return NULL;
+    te->slot = slot;
+    te->index = -1;
+    eventLoop->timeEventSlots[slot] = te;
+    eventLoop->timeEventSlotCount++;
+    return te;
+}
+
+static void aeTimeEventRelease(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    te->index = -1;
+    te->next = eventLoop->timeEventFree;
+    eventLoop->timeEventFree = te;
+}
+
+/* Finish an event that is no longer queued. */
+static void aeTimeEventDrop(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    aeTimeEventRelease(eventLoop, te);
 }
 
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc)
 {
-    long long id = eventLoop->timeEventNextId++;
     aeTimeEvent *te;
 
-    te = zmalloc(sizeof(*te));
-    if (te == NULL) return AE_ERR;
-    te->id = id;
-    aeAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
+    if ((te = aeTimeEventAlloc(eventLoop)) == NULL) return AE_ERR;
+    te->id = (eventLoop->timeEventNextId++ << AE_TIME_SLOT_BITS) | te->slot;
+    te->when = aeGetTime() + milliseconds;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->next = eventLoop->timeEventHead;
-    eventLoop->timeEventHead = te;
-    return id;
+    te->next = NULL;
+    if (aeTimeEventPush(eventLoop, te) == AE_ERR) {
+        aeTimeEventRelease(eventLoop, te);
+        return AE_ERR;
+    }
+    return te->id;
 }
 
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te, *prev = NULL;
-
-    te = eventLoop->timeEventHead;
-    while(te) {
-        if (te->id == id) {
-            if (prev == NULL)
-                eventLoop->timeEventHead = te->next;
-            else
-                prev->next = te->next;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            zfree(te);
-            return AE_OK;
-        }
-        prev = te;
-        te = te->next;
-    }
-    return AE_ERR; /* NO event with the specified ID found */
+    long long slot = id & AE_TIME_SLOT_MASK;
+    aeTimeEvent *te;
+
+    if (id < 0 || slot >= eventLoop->timeEventSlotCount)
+        return AE_ERR;
+    te = eventLoop->timeEventSlots[slot];
+    if (te->id != id || te->index == -1)
+        return AE_ERR; /* NO event with the specified ID found */
+
+    aeTimeEventRemove(eventLoop, te->index);
+    aeTimeEventDrop(eventLoop, te);
+    return AE_OK;
 }
 
 /* Search the first timer to fire.
  * This operation is useful to know how many time the select can be
  * put in sleep without to delay any event.
- * If there are no timers NULL is returned.
- *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
+ * If there are no timers NULL is returned. */
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
-    }
-    return nearest;
+    return eventLoop->timeEventCount ? eventLoop->timeEvents[0] : NULL;
 }
 
 /* Process time events */
 static int processTimeEvents(aeEventLoop *eventLoop) {
-    int processed = 0;
-    aeTimeEvent *te;
-    long long maxId;
+    int processed = 0, j;
+    aeTimeEvent *te, *deferred = NULL;
+    long long firstNewId, now_ms;
     time_t now = time(NULL);
 
     /* If the system clock is moved to the future, and then set back to the
@@ -251,57 +559,46 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
      * Here we try to detect system clock skews, and force all the time
      * events to be processed ASAP when this happens: the idea is that
      * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
+     * indefinitely, and practice suggests it is. Zeroing every key keeps
+     * the heap ordered. */
     if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
+        for (j = 0; j < eventLoop->timeEventCount; j++)
+            eventLoop->timeEvents[j]->when = 0;
     }
     eventLoop->lastTime = now;
 
-    te = eventLoop->timeEventHead;
-    maxId = eventLoop->timeEventNextId-1;
-    while(te) {
-        long now_sec, now_ms;
-        long long id;
-
-        if (te->id > maxId) {
-            te = te->next;
+    /* Events registered by handlers while we are processing are set aside
+     * and re-added afterwards, in order to don't loop forever. */
+    firstNewId = eventLoop->timeEventNextId << AE_TIME_SLOT_BITS;
+    now_ms = aeGetTime();
+    while (eventLoop->timeEventCount &&
+           eventLoop->timeEvents[0]->when <= now_ms)
+    {
+        int retval;
+
+        te = aeTimeEventRemove(eventLoop, 0);
+        if (te->id >= firstNewId) {
+            te->next = deferred;
+            deferred = te;
             continue;
         }
-        aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
-            int retval;
-
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            processed++;
-            /* After an event is processed our time event list may
-             * no longer be the same, so we restart from head.
-             * Still we make sure to don't process events registered
-             * by event handlers itself in order to don't loop forever.
-             * To do so we saved the max ID we want to handle.
-             *
-             * FUTURE OPTIMIZATIONS:
-             * Note that this is NOT great algorithmically. Redis uses
-             * a single time event so it's not a problem but the right
-             * way to do this is to add the new elements on head, and
-             * to flag deleted elements in a special way for later
-             * deletion (putting references to the nodes to delete into
-             * another linked list). */
-            if (retval != AE_NOMORE) {
-                aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            } else {
-                aeDeleteTimeEvent(eventLoop, id);
-            }
-            te = eventLoop->timeEventHead;
-        } else {
-            te = te->next;
+
+        retval = te->timeProc(eventLoop, te->id, te->clientData);
+        processed++;
+        if (retval == AE_NOMORE) {
+            aeTimeEventDrop(eventLoop, te);
+            continue;
         }
+        te->when = aeGetTime() + retval;
+        if (aeTimeEventPush(eventLoop, te) == AE_ERR)
+            aeTimeEventDrop(eventLoop, te);
+    }
+
+    while ((te = deferred) != NULL) {
+        deferred = te->next;
+        te->next = NULL;
+        if (aeTimeEventPush(eventLoop, te) == AE_ERR)
+            aeTimeEventDrop(eventLoop, te);
     }
     return processed;
 }
@@ -339,21 +636,14 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
         if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
             shortest = aeSearchNearestTimer(eventLoop);
         if (shortest) {
-            long now_sec, now_ms;
-
             /* Calculate the time missing for the nearest
              * timer to fire. */
-            aeGetTime(&now_sec, &now_ms);
+            long long ms = shortest->when - aeGetTime();
+
+            if (ms < 0) ms = 0;
             tvp = &tv;
-            tvp->tv_sec = shortest->when_sec - now_sec;
-            if (shortest->when_ms < now_ms) {
-                tvp->tv_usec = ((shortest->when_ms+1000) - now_ms)*1000;
-                tvp->tv_sec --;
-            } else {
-                tvp->tv_usec = (shortest->when_ms - now_ms)*1000;
-            }
-            if (tvp->tv_sec < 0) tvp->tv_sec = 0;
-            if (tvp->tv_usec < 0) tvp->tv_usec = 0;
+            tvp->tv_sec = ms/1000;
+            tvp->tv_usec = (ms%1000)*1000;
         } else {
             /* If we have to check for events but need to return
              * ASAP because of AE_DONT_WAIT we need to se the timeout
@@ -369,11 +659,14 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 
         numevents = aeApiPoll(eventLoop, tvp);
         for (j = 0; j < numevents; j++) {
-            aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
             int mask = eventLoop->fired[j].mask;
             int fd = eventLoop->fired[j].fd;
+            int slot = aeSlotOf(eventLoop, fd);
             int rfired = 0;
 
+            if (slot == -1) continue;
+            aeFileEvent *fe = &eventLoop->events[slot];
+
 	    /* note the fe->mask & mask & ... code: maybe an already processed
              * event removed an element that fired and we still didn't
              * processed, so we check if the event is still valid. */
@@ -381,7 +674,9 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
                 rfired = 1;
                 fe->rfileProc(eventLoop,fd,fe->clientData,mask);
             }
-            if (fe->mask & mask & AE_WRITABLE) {
+            /* The read handler may have closed the fd and handed its slot
+             * to another one. */
+            if (fe->fd == fd && fe->mask & mask & AE_WRITABLE) {
                 if (!rfired || fe->wfileProc != fe->rfileProc)
                     fe->wfileProc(eventLoop,fd,fe->clientData,mask);
             }
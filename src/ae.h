@@ -34,6 +34,9 @@
 #ifndef __AE_H__
 #define __AE_H__
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #define AE_OK 0
 #define AE_ERR -1
 
@@ -48,6 +51,8 @@
 
 #define AE_NOMORE -1
 
+#define AE_RING_COPY 1 /* aeRingWrite() copies, the caller reuses buffers */
+
 /* Macros */
 #define AE_NOTUSED(V) ((void) V)
 
@@ -76,6 +81,9 @@ typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
 /* File event structure */
 typedef struct aeFileEvent {
     int mask; /* one of AE_(READABLE|WRITABLE) */
+    int fd;   /* file descriptor using this slot */
+    int held; /* kept by the polling API once the mask is AE_NONE */
+    int next; /* next free slot */
     aeFileProc *rfileProc;
     aeFileProc *wfileProc;
     void *clientData;
@@ -85,12 +93,13 @@ typedef struct aeFileEvent {
 /* Time event structure */
 typedef struct aeTimeEvent {
     long long id; /* time event identifier. */
-    long when_sec; /* seconds */
-    long when_ms; /* milliseconds */
+    long long when; /* milliseconds since the epoch */
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct aeTimeEvent *next;
+    int index; /* position in the heap, -1 when not queued */
+    int slot;  /* position in the loop's table of nodes */
+    struct aeTimeEvent *next; /* free list and deferred list link */
 } aeTimeEvent;
 //时间事件
 
@@ -103,12 +112,22 @@ typedef struct aeFiredEvent {
 /* State of an event based program */
 typedef struct aeEventLoop {
     int maxfd;   /* highest file descriptor currently registered */
-    int setsize; /* max number of file descriptors tracked */
+    int setsize; /* max number of slots tracked */
     long long timeEventNextId;
     time_t lastTime;     /* Used to detect system clock skew */
-    aeFileEvent *events; /* Registered events */
+    int *slots;          /* Slot of each file descriptor, -1 when none */
+    int fdsize;          /* Length of slots */
+    int slotCount;       /* Slots handed out so far, in use or free */
+    int freeSlot;        /* First free slot, -1 when none */
+    aeFileEvent *events; /* Registered events, indexed by slot */
     aeFiredEvent *fired; /* Fired events */
-    aeTimeEvent *timeEventHead;
+    aeTimeEvent **timeEvents; /* Binary min-heap ordered by 'when' */
+    int timeEventCount;
+    int timeEventSize;
+    aeTimeEvent *timeEventFree; /* Pool of released time events */
+    aeTimeEvent **timeEventSlots; /* Every node, indexed by the id's slot */
+    int timeEventSlotCount;
+    int timeEventSlotSize;
     int stop;
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
@@ -121,10 +140,22 @@ aeEventLoop *aeCreateEventLoop(int setsize);
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop);
 void aeStop(aeEventLoop *eventLoop);
+int aeGetSetSize(aeEventLoop *eventLoop);
+size_t aeGetMemoryUsage(aeEventLoop *eventLoop);
+int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
 int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
         aeFileProc *proc, void *clientData);
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask);
 int aeGetFileEvents(aeEventLoop *eventLoop, int fd);
+int aeRingCreate(aeEventLoop *eventLoop, int count, int size);
+int aeRingAttach(aeEventLoop *eventLoop, int fd, int flags);
+void aeRingDetach(aeEventLoop *eventLoop, int fd);
+void aeRingRelease(aeEventLoop *eventLoop, int fd);
+ssize_t aeRingRead(aeEventLoop *eventLoop, int fd, char **buf, size_t max);
+size_t aeRingPending(aeEventLoop *eventLoop, int fd);
+ssize_t aeRingWrite(aeEventLoop *eventLoop, int fd, const struct iovec *iov,
+        int iovcnt);
+int aeRingWriting(aeEventLoop *eventLoop, int fd);
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc);
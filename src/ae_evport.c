@@ -94,6 +94,11 @@ static int aeApiCreate(aeEventLoop *eventLoop) {
     return 0;
 }
 
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    /* Nothing to resize here. */
+    return 0;
+}
+
 static void aeApiFree(aeEventLoop *eventLoop) {
     aeApiState *state = eventLoop->apidata;
 
@@ -156,7 +161,7 @@ static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
      * must be sure to include whatever events are already associated when
      * we call port_associate() again.
      */
-    fullmask = mask | eventLoop->events[fd].mask;
+    fullmask = mask | eventLoop->events[aeSlotOf(eventLoop, fd)].mask;
     pfd = aeApiLookupPending(state, fd);
 
     if (pfd != -1) {
@@ -209,7 +214,7 @@ static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int mask) {
      * the fact that our caller has already updated the mask in the eventLoop.
      */
 
-    fullmask = eventLoop->events[fd].mask;
+    fullmask = eventLoop->events[aeSlotOf(eventLoop, fd)].mask;
     if (fullmask == AE_NONE) {
         /*
          * We're removing *all* events, so use port_dissociate to remove the
@@ -277,7 +282,8 @@ static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
      * So if we get ETIME, we check nevents, too.
      */
     nevents = 1;
-    if (port_getn(state->portfd, event, MAX_EVENT_BATCHSZ, &nevents,
+    if (port_getn(state->portfd, event, eventLoop->setsize < MAX_EVENT_BATCHSZ ?
+        eventLoop->setsize : MAX_EVENT_BATCHSZ, &nevents,
         tsp) == -1 && (errno != ETIME || nevents == 0)) {
         if (errno == ETIME || errno == EINTR)
             return 0;
@@ -310,6 +316,11 @@ static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
     return nevents;
 }
 
+static size_t aeApiMemory(aeEventLoop *eventLoop) {
+    AE_NOTUSED(eventLoop);
+    return sizeof(aeApiState);
+}
+
 static char *aeApiName(void) {
     return "evport";
 }
@@ -0,0 +1,973 @@
+/* Linux io_uring(7) based ae.c module
+ *
+ * Readiness is requested with one-shot IORING_OP_POLL_ADD requests. Interest
+ * changes made by aeCreateFileEvent() and aeDeleteFileEvent() only mark the
+ * fd as dirty; the resulting poll requests are queued in the submission ring
+ * right before waiting and submitted with the same io_uring_enter() call, so
+ * toggling AE_WRITABLE on every request costs no system call at all.
+ *
+ * A one-shot poll checks the current state of the file when it is armed, and
+ * every fd that fired is re-armed on the next iteration, which gives the same
+ * level triggered semantics as the other modules.
+ *
+ * Sockets handed to aeApiRingAttach() are not polled at all. A multishot
+ * IORING_OP_RECV reads them into buffers the kernel picks from a ring
+ * registered with IORING_REGISTER_PBUF_RING, and the received buffers queue
+ * per fd until aeApiRingRead() hands them out without another copy. Writes
+ * are sent with IORING_OP_SENDMSG straight from the caller's buffers, which
+ * must stay untouched until the send completes, or from a per fd copy when
+ * the fd was attached with AE_RING_COPY. AE_READABLE
+ * fires while data, EOF or an error is queued and AE_WRITABLE while no send
+ * is in flight, both level triggered like the poll requests.
+ * aeApiRingRelease() cancels the recv and the fd is polled again once the
+ * data already received has been read.
+ *
+ * When io_uring is not available (old kernel, seccomp, sysctl) the loop falls
+ * back to the epoll module, and so does every socket that is not attached.
+ */
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define aeApiState      aeEpollState
+#define aeApiCreate     aeEpollCreate
+#define aeApiFree       aeEpollFree
+#define aeApiResize     aeEpollResize
+#define aeApiAddEvent   aeEpollAddEvent
+#define aeApiDelEvent   aeEpollDelEvent
+#define aeApiPoll       aeEpollPoll
+#define aeApiMemory     aeEpollMemory
+#define aeApiName       aeEpollName
+#include "ae_epoll.c"
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiFree
+#undef aeApiResize
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiPoll
+#undef aeApiMemory
+#undef aeApiName
+
+#define AE_URING_ENTRIES 4096
+#define AE_URING_REMOVE  UINT64_MAX
+
+#ifdef IORING_RECV_MULTISHOT
+#define AE_HAVE_RING
+#endif
+
+/* user_data of recv and send requests, the low bits hold the slot and the
+ * high 32 bits the generation of the slot's ring state. */
+#define AE_URING_RECV    (1u<<31)
+#define AE_URING_SEND    (1u<<30)
+#define AE_URING_SLOTMASK (AE_URING_SEND-1)
+#define AE_URING_BGID    0
+#define AE_URING_BUFS    32768
+
+typedef struct aeRingFd {
+    uint32_t gen;
+    int attached;
+    int recving;       /* multishot recv armed */
+    int releasing;     /* goes back to polling once drained */
+    int sending;       /* send in flight */
+    int eof;
+    int error;         /* errno of a failed recv or send */
+    int head, tail;    /* queued buffer ids, -1 when empty */
+    unsigned off;      /* bytes of the head buffer already read */
+    size_t pending;    /* queued bytes */
+    int copy;          /* writes are copied to out */
+    struct aeRingMsg *msg; /* message of the last send */
+    char *out;
+    size_t outsize;
+} aeRingFd;
+
+/* The message of the send in flight. It is read by the kernel when the
+ * request is submitted and by aeRingComplete() to resume a short send. */
+typedef struct aeRingMsg {
+    struct msghdr hdr;
+    size_t left;       /* bytes not sent yet */
+    int iovsize;
+    struct iovec iov[];
+} aeRingMsg;
+
+/* Send state of a detached fd, kept until the kernel is done with it. */
+typedef struct aeRingOrphan {
+    int slot;
+    uint32_t gen;
+    aeRingMsg *msg;
+    char *out;
+    struct aeRingOrphan *next;
+} aeRingOrphan;
+
+typedef struct aeApiState {
+    /* Must be the first member: when io_uring is unavailable the epoll
+     * functions are called with this state as the loop's apidata. */
+    aeEpollState epoll;
+    int fallback;
+
+    int ring;
+    unsigned *sqhead, *sqtail, *sqarray, *sqflags, sqmask, sqentries;
+    unsigned *cqhead, *cqtail, cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqmap, *cqmap;
+    size_t sqmapsize, cqmapsize, sqessize;
+    unsigned pending; /* queued SQEs not submitted yet */
+
+    /* Per fd state is indexed by the fd's slot in the loop. */
+    int *armed;        /* AE mask of the poll request armed per slot */
+    uint32_t *gen;     /* generation of the poll request per slot */
+    int *dirty;        /* slots whose interest must be re-armed */
+    int ndirty;
+    char *isdirty;
+
+    int ringok;
+    struct io_uring_buf_ring *br;
+    size_t brsize;
+    char *bufs;
+    unsigned nbufs, bufsize, held;
+    unsigned short brtail;
+    int *bnext;        /* next queued buffer after each buffer id */
+    unsigned *blen;    /* received bytes in each buffer id */
+    int lent;          /* buffer handed out by the last read, or -1 */
+    aeRingFd *rfd;
+    int rfdsize;
+    int *ready;        /* attached slots that may fire without a poll */
+    int nready;
+    char *isready;
+    aeRingOrphan *orphans;
+} aeApiState;
+
+static int aeUringEnter(aeApiState *state, unsigned submit, unsigned wait,
+        struct timeval *tvp)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned flags = 0;
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    /* Completions that did not fit in the ring are only moved into it by
+     * a call that gets events, so ask for none instead of not asking. */
+    if (!wait && __atomic_load_n(state->sqflags, __ATOMIC_RELAXED) &
+            IORING_SQ_CQ_OVERFLOW)
+        flags |= IORING_ENTER_GETEVENTS;
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (tvp) {
+            ts.tv_sec = tvp->tv_sec;
+            ts.tv_nsec = tvp->tv_usec*1000;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof(arg);
+        }
+    }
+    return syscall(__NR_io_uring_enter, state->ring, submit, wait, flags,
+            argp, argsz);
+}
+
+static void aeUringSubmit(aeApiState *state) {
+    while (state->pending) {
+        int n = aeUringEnter(state, state->pending, 0, NULL);
+        if (n <= 0) break;
+        state->pending -= n;
+    }
+}
+
+static struct io_uring_sqe *aeUringQueue(aeApiState *state, int op, int fd,
+        unsigned events, uint64_t addr, uint64_t data)
+{
+    unsigned tail = *state->sqtail;
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (tail - __atomic_load_n(state->sqhead, __ATOMIC_ACQUIRE) == state->sqentries)
+        aeUringSubmit(state);
+
+    idx = tail & state->sqmask;
+    sqe = &state->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->addr = addr;
+    sqe->user_data = data;
+    state->sqarray[idx] = idx;
+    __atomic_store_n(state->sqtail, tail+1, __ATOMIC_RELEASE);
+    state->pending++;
+    return sqe;
+}
+
+static uint64_t aeUringData(aeApiState *state, int slot) {
+    return ((uint64_t)state->gen[slot] << 32) | (uint32_t)slot;
+}
+
+/* Cancel the poll request armed for the slot, if any. Stale completions of
+ * the old request are recognized by their generation and ignored, so the
+ * slot can be handed to another fd right away. */
+static void aeUringDisarm(aeApiState *state, int slot) {
+    if (state->armed[slot] == AE_NONE) return;
+    aeUringQueue(state, IORING_OP_POLL_REMOVE, -1, 0, aeUringData(state, slot),
+            AE_URING_REMOVE);
+    state->armed[slot] = AE_NONE;
+    state->gen[slot]++;
+}
+
+static void aeUringMarkDirty(aeApiState *state, int slot) {
+    if (state->isdirty[slot]) return;
+    state->isdirty[slot] = 1;
+    state->dirty[state->ndirty++] = slot;
+}
+
+static void aeUringArm(aeEventLoop *eventLoop, aeApiState *state) {
+    int j;
+
+    for (j = 0; j < state->ndirty; j++) {
+        int slot = state->dirty[j];
+        aeFileEvent *fe = &eventLoop->events[slot];
+        int mask = state->rfd[slot].attached ? AE_NONE : fe->mask;
+        unsigned events = 0;
+
+        state->isdirty[slot] = 0;
+        if (state->armed[slot] == mask) continue;
+        aeUringDisarm(state, slot);
+        if (mask == AE_NONE) continue;
+
+        if (mask & AE_READABLE) events |= POLLIN;
+        if (mask & AE_WRITABLE) events |= POLLOUT;
+        aeUringQueue(state, IORING_OP_POLL_ADD, fe->fd, events, 0,
+                aeUringData(state, slot));
+        state->armed[slot] = mask;
+    }
+    state->ndirty = 0;
+}
+
+#ifdef AE_HAVE_RING
+static uint64_t aeRingData(aeApiState *state, int slot, uint32_t kind) {
+    return ((uint64_t)state->rfd[slot].gen << 32) | kind | (uint32_t)slot;
+}
+
+static void aeRingMarkReady(aeApiState *state, int slot) {
+    if (state->isready[slot]) return;
+    state->isready[slot] = 1;
+    state->ready[state->nready++] = slot;
+}
+
+/* Hand a buffer back to the kernel. The ring tail overlays the resv field
+ * of the first entry, so entries are written field by field. */
+static void aeRingPush(aeApiState *state, int bid) {
+    struct io_uring_buf *b = &state->br->bufs[state->brtail & (state->nbufs-1)];
+
+    b->addr = (uint64_t)(uintptr_t)(state->bufs + (size_t)bid*state->bufsize);
+    b->len = state->bufsize;
+    b->bid = bid;
+    state->brtail++;
+    __atomic_store_n(&state->br->tail, state->brtail, __ATOMIC_RELEASE);
+}
+
+static void aeRingRecycle(aeApiState *state, int bid) {
+    aeRingPush(state, bid);
+    state->held--;
+}
+
+/* The buffer returned by the last read stays valid until the next read or
+ * poll, the caller parses it in place before reading again. */
+static void aeRingReturnLent(aeApiState *state) {
+    if (state->lent == -1) return;
+    aeRingRecycle(state, state->lent);
+    state->lent = -1;
+}
+
+static void aeRingArmRecv(aeApiState *state, int slot, int fd) {
+    struct io_uring_sqe *sqe = aeUringQueue(state, IORING_OP_RECV, fd, 0, 0,
+            aeRingData(state, slot, AE_URING_RECV));
+
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = AE_URING_BGID;
+    state->rfd[slot].recving = 1;
+}
+
+static void aeRingSend(aeApiState *state, int slot, int fd) {
+    aeRingFd *r = &state->rfd[slot];
+    struct io_uring_sqe *sqe = aeUringQueue(state, IORING_OP_SENDMSG, fd, 0,
+            (uint64_t)(uintptr_t)&r->msg->hdr,
+            aeRingData(state, slot, AE_URING_SEND));
+
+    sqe->msg_flags = MSG_NOSIGNAL|MSG_WAITALL;
+    r->sending = 1;
+}
+
+/* Drop the first n sent bytes from the message so the rest can be sent. */
+static void aeRingAdvance(aeRingMsg *s, size_t n) {
+    struct iovec *v = s->hdr.msg_iov;
+
+    s->left -= n;
+    while (n >= v->iov_len) {
+        n -= v->iov_len;
+        v++;
+        s->hdr.msg_iovlen--;
+    }
+    v->iov_base = (char *)v->iov_base + n;
+    v->iov_len -= n;
+    s->hdr.msg_iov = v;
+}
+
+static void aeRingOrphanDone(aeApiState *state, int slot, uint32_t gen) {
+    aeRingOrphan **o;
+
+    for (o = &state->orphans; *o; o = &(*o)->next) {
+        if ((*o)->slot == slot && (*o)->gen == gen) {
+            aeRingOrphan *done = *o;
+            *o = done->next;
+            zfree(done->msg);
+            zfree(done->out);
+            zfree(done);
+            return;
+        }
+    }
+}
+
+static void aeRingComplete(aeEventLoop *eventLoop, aeApiState *state,
+        struct io_uring_cqe *cqe)
+{
+    int slot = (int)(cqe->user_data & AE_URING_SLOTMASK);
+    uint32_t gen = (uint32_t)(cqe->user_data >> 32);
+    int bid = -1;
+    aeRingFd *r = slot < eventLoop->setsize ? &state->rfd[slot] : NULL;
+    int stale = !r || !r->attached || r->gen != gen;
+
+    if (cqe->user_data & AE_URING_SEND) {
+        if (stale) {
+            aeRingOrphanDone(state, slot, gen);
+            return;
+        }
+        if (cqe->res <= 0) {
+            r->error = cqe->res ? -cqe->res : EPIPE;
+            r->sending = 0;
+        } else if ((size_t)cqe->res < r->msg->left) {
+            aeRingAdvance(r->msg, cqe->res);
+            aeRingSend(state, slot, eventLoop->events[slot].fd);
+        } else {
+            r->sending = 0;
+        }
+        aeRingMarkReady(state, slot);
+        return;
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        state->held++;
+    }
+    if (stale) {
+        if (bid != -1) aeRingRecycle(state, bid);
+        return;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) r->recving = 0;
+    if (bid != -1 && cqe->res > 0) {
+        state->blen[bid] = cqe->res;
+        state->bnext[bid] = -1;
+        if (r->tail != -1) state->bnext[r->tail] = bid;
+        else r->head = bid;
+        r->tail = bid;
+        r->pending += cqe->res;
+    } else if (bid != -1) {
+        aeRingRecycle(state, bid);
+    }
+
+    /* Running out of buffers ends a multishot recv, it is armed again once
+     * buffers come back. Kernels without multishot recv reject it, so no
+     * more sockets are attached. */
+    if (cqe->res == 0) {
+        r->eof = 1;
+    } else if (cqe->res == -EINVAL) {
+        r->error = EINVAL;
+        state->ringok = 0;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS &&
+            !(r->releasing && cqe->res == -ECANCELED)) {
+        r->error = -cqe->res;
+    }
+    aeRingMarkReady(state, slot);
+}
+
+/* Forget the ring state of the fd and let the loop have its slot back. A
+ * send still in flight keeps its state until it completes. */
+static void aeRingReset(aeEventLoop *eventLoop, aeApiState *state, int slot) {
+    aeRingFd *r = &state->rfd[slot];
+    uint32_t gen;
+
+    if (r->sending) {
+        aeRingOrphan *o = zmalloc(sizeof(*o));
+        o->slot = slot;
+        o->gen = r->gen;
+        o->msg = r->msg;
+        o->out = r->out;
+        o->next = state->orphans;
+        state->orphans = o;
+    } else {
+        zfree(r->msg);
+        zfree(r->out);
+    }
+
+    gen = r->gen + 1;
+    memset(r, 0, sizeof(*r));
+    r->gen = gen;
+    eventLoop->events[slot].held = 0;
+    aeSlotPut(eventLoop, eventLoop->events[slot].fd);
+}
+
+static int aeRingSetup(aeApiState *state, int count, int size) {
+    struct io_uring_buf_reg reg;
+    unsigned nbufs = 1;
+    int bid;
+
+    while (nbufs < (unsigned)count && nbufs < AE_URING_BUFS) nbufs <<= 1;
+
+    state->brsize = nbufs*sizeof(struct io_uring_buf);
+    state->br = mmap(NULL, state->brsize, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (state->br == MAP_FAILED) {
+        state->br = NULL;
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)state->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = AE_URING_BGID;
+    if (syscall(__NR_io_uring_register, state->ring,
+            IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        return -1;
+
+    state->nbufs = nbufs;
+    state->bufsize = size;
+    state->bufs = zmalloc((size_t)nbufs*size);
+    state->bnext = zmalloc(sizeof(int)*nbufs);
+    state->blen = zmalloc(sizeof(unsigned)*nbufs);
+    if (!state->bufs || !state->bnext || !state->blen) return -1;
+    for (bid = 0; bid < (int)nbufs; bid++) aeRingPush(state, bid);
+    state->ringok = 1;
+    return 0;
+}
+
+/* Collect the attached fds that fire without a poll, or only count them
+ * when fired is NULL. fds stay on the ready list while they fire or while
+ * their recv waits for buffers. */
+static int aeRingScan(aeEventLoop *eventLoop, aeApiState *state,
+        aeFiredEvent *fired)
+{
+    int j, n = 0, nready = state->nready;
+
+    state->nready = 0;
+    for (j = 0; j < nready; j++) {
+        int slot = state->ready[j];
+        aeRingFd *r = &state->rfd[slot];
+        aeFileEvent *fe = &eventLoop->events[slot];
+        int mask = fe->mask, fire = 0;
+
+        state->isready[slot] = 0;
+        if (!r->attached) continue;
+
+        if (r->releasing && !r->recving && r->head == -1 && !r->sending &&
+            !r->eof && !r->error) {
+            aeUringMarkDirty(state, slot);
+            aeRingReset(eventLoop, state, slot);
+            continue;
+        }
+        if (!r->recving && !r->releasing && !r->eof && !r->error &&
+            state->held < state->nbufs)
+            aeRingArmRecv(state, slot, fe->fd);
+        if ((mask & AE_READABLE) && (r->pending || r->eof || r->error))
+            fire |= AE_READABLE;
+        if ((mask & AE_WRITABLE) && (!r->sending || r->error))
+            fire |= AE_WRITABLE;
+
+        if (fire && fired) {
+            fired[n].fd = fe->fd;
+            fired[n].mask = fire;
+        }
+        if (fire) n++;
+        if (fire || (!r->recving && !r->releasing && !r->eof && !r->error))
+            aeRingMarkReady(state, slot);
+    }
+    return n;
+}
+#endif
+
+static void aeUringFree(aeApiState *state) {
+    if (state->sqes) munmap(state->sqes, state->sqessize);
+    if (state->cqmap && state->cqmap != state->sqmap)
+        munmap(state->cqmap, state->cqmapsize);
+    if (state->sqmap) munmap(state->sqmap, state->sqmapsize);
+    if (state->ring != -1) close(state->ring);
+    if (state->br) munmap(state->br, state->brsize);
+    if (state->rfd) {
+        int slot;
+        for (slot = 0; slot < state->rfdsize; slot++) {
+            zfree(state->rfd[slot].msg);
+            zfree(state->rfd[slot].out);
+        }
+    }
+    while (state->orphans) {
+        aeRingOrphan *o = state->orphans;
+        state->orphans = o->next;
+        zfree(o->msg);
+        zfree(o->out);
+        zfree(o);
+    }
+    zfree(state->armed);
+    zfree(state->gen);
+    zfree(state->dirty);
+    zfree(state->isdirty);
+    zfree(state->bufs);
+    zfree(state->bnext);
+    zfree(state->blen);
+    zfree(state->rfd);
+    zfree(state->ready);
+    zfree(state->isready);
+    zfree(state);
+}
+
+static int aeUringCreate(aeEventLoop *eventLoop, aeApiState *state) {
+    struct io_uring_params p;
+    unsigned entries = 1;
+    char *sq, *cq;
+
+    while (entries < (unsigned)eventLoop->setsize && entries < AE_URING_ENTRIES)
+        entries <<= 1;
+
+    memset(&p, 0, sizeof(p));
+    state->ring = syscall(__NR_io_uring_setup, entries, &p);
+    if (state->ring == -1) return -1;
+    if (!(p.features & IORING_FEAT_EXT_ARG)) return -1;
+
+    state->sqmapsize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    state->cqmapsize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cqmapsize > state->sqmapsize)
+            state->sqmapsize = state->cqmapsize;
+        state->cqmapsize = state->sqmapsize;
+    }
+
+    sq = mmap(NULL, state->sqmapsize, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, state->ring, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) return -1;
+    state->sqmap = sq;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, state->cqmapsize, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE, state->ring, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) return -1;
+    }
+    state->cqmap = cq;
+
+    state->sqessize = p.sq_entries*sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL, state->sqessize, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, state->ring, IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        return -1;
+    }
+
+    state->sqhead = (unsigned *)(sq + p.sq_off.head);
+    state->sqtail = (unsigned *)(sq + p.sq_off.tail);
+    state->sqarray = (unsigned *)(sq + p.sq_off.array);
+    state->sqflags = (unsigned *)(sq + p.sq_off.flags);
+    state->sqmask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    state->sqentries = *(unsigned *)(sq + p.sq_off.ring_entries);
+    state->cqhead = (unsigned *)(cq + p.cq_off.head);
+    state->cqtail = (unsigned *)(cq + p.cq_off.tail);
+    state->cqmask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    state->armed = zcalloc(sizeof(int)*eventLoop->setsize);
+    state->gen = zcalloc(sizeof(uint32_t)*eventLoop->setsize);
+    state->dirty = zmalloc(sizeof(int)*eventLoop->setsize);
+    state->isdirty = zcalloc(eventLoop->setsize);
+    state->rfd = zcalloc(sizeof(aeRingFd)*eventLoop->setsize);
+    state->rfdsize = eventLoop->setsize;
+    state->ready = zmalloc(sizeof(int)*eventLoop->setsize);
+    state->isready = zcalloc(eventLoop->setsize);
+    state->lent = -1;
+    if (!state->armed || !state->gen || !state->dirty || !state->isdirty ||
+        !state->rfd || !state->ready || !state->isready)
+        return -1;
+    return 0;
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    aeApiState *state = zcalloc(sizeof(aeApiState));
+    aeEpollState *epoll;
+
+    if (!state) return -1;
+    state->ring = -1;
+    if (aeUringCreate(eventLoop, state) == 0) {
+        eventLoop->apidata = state;
+        return 0;
+    }
+    aeUringFree(state);
+
+    if (aeEpollCreate(eventLoop) == -1) return -1;
+    epoll = eventLoop->apidata;
+    if ((state = zcalloc(sizeof(aeApiState))) == NULL) {
+        aeEpollFree(eventLoop);
+        return -1;
+    }
+    state->epoll = *epoll;
+    state->fallback = 1;
+    state->ring = -1;
+    zfree(epoll);
+    eventLoop->apidata = state;
+    return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->fallback) {
+        aeEpollFree(eventLoop);
+        return;
+    }
+    aeUringFree(state);
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+    int old = eventLoop->setsize;
+    void *p;
+
+    if (state->fallback) return aeEpollResize(eventLoop, setsize);
+
+    if ((p = zrealloc(state->armed, sizeof(int)*setsize)) == NULL) return -1;
+    state->armed = p;
+    if ((p = zrealloc(state->gen, sizeof(uint32_t)*setsize)) == NULL) return -1;
+    state->gen = p;
+    if ((p = zrealloc(state->dirty, sizeof(int)*setsize)) == NULL) return -1;
+    state->dirty = p;
+    if ((p = zrealloc(state->isdirty, setsize)) == NULL) return -1;
+    state->isdirty = p;
+    if ((p = zrealloc(state->rfd, sizeof(aeRingFd)*setsize)) == NULL) return -1;
+    state->rfd = p;
+    state->rfdsize = setsize;
+    if ((p = zrealloc(state->ready, sizeof(int)*setsize)) == NULL) return -1;
+    state->ready = p;
+    if ((p = zrealloc(state->isready, setsize)) == NULL) return -1;
+    state->isready = p;
+
+    if (setsize > old) {
+        memset(state->armed+old, 0, sizeof(int)*(setsize-old));
+        memset(state->gen+old, 0, sizeof(uint32_t)*(setsize-old));
+        memset(state->isdirty+old, 0, setsize-old);
+        memset(state->rfd+old, 0, sizeof(aeRingFd)*(setsize-old));
+        memset(state->isready+old, 0, setsize-old);
+    }
+    return 0;
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+    int slot = aeSlotOf(eventLoop, fd);
+
+    if (state->fallback) return aeEpollAddEvent(eventLoop, fd, mask);
+#ifdef AE_HAVE_RING
+    if (state->rfd[slot].attached) {
+        aeRingMarkReady(state, slot);
+        return 0;
+    }
+#endif
+    aeUringMarkDirty(state, slot);
+    return 0;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+    int slot = aeSlotOf(eventLoop, fd);
+
+    if (state->fallback) {
+        aeEpollDelEvent(eventLoop, fd, delmask);
+        return;
+    }
+    /* The fd is about to be closed and may be reused right away, so the
+     * poll request holding the old file must be cancelled now. */
+    if (eventLoop->events[slot].mask == AE_NONE) aeUringDisarm(state, slot);
+    aeUringMarkDirty(state, slot);
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    unsigned head, tail, wait;
+    int retval, numevents = 0;
+
+    if (state->fallback) return aeEpollPoll(eventLoop, tvp);
+
+    wait = !(tvp && tvp->tv_sec == 0 && tvp->tv_usec == 0);
+#ifdef AE_HAVE_RING
+    if (state->br) {
+        aeRingReturnLent(state);
+        if (aeRingScan(eventLoop, state, NULL)) wait = 0;
+    }
+#endif
+    aeUringArm(eventLoop, state);
+    retval = aeUringEnter(state, state->pending, wait, tvp);
+    if (retval > 0) state->pending -= retval;
+
+    head = *state->cqhead;
+    tail = __atomic_load_n(state->cqtail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &state->cqes[head & state->cqmask];
+        int slot = (int)(uint32_t)cqe->user_data;
+        int mask = 0;
+
+        if (cqe->user_data == AE_URING_REMOVE) continue;
+#ifdef AE_HAVE_RING
+        if (cqe->user_data & (AE_URING_RECV|AE_URING_SEND)) {
+            aeRingComplete(eventLoop, state, cqe);
+            continue;
+        }
+#endif
+        if (slot >= eventLoop->setsize ||
+            cqe->user_data != aeUringData(state, slot))
+            continue;
+
+        state->armed[slot] = AE_NONE;
+        aeUringMarkDirty(state, slot);
+        if (cqe->res < 0) continue;
+
+        if (cqe->res & POLLIN) mask |= AE_READABLE;
+        if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+        if (cqe->res & POLLERR) mask |= AE_WRITABLE|AE_READABLE;
+        if (cqe->res & POLLHUP) mask |= AE_WRITABLE;
+        eventLoop->fired[numevents].fd = eventLoop->events[slot].fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cqhead, head, __ATOMIC_RELEASE);
+#ifdef AE_HAVE_RING
+    if (state->br)
+        numevents += aeRingScan(eventLoop, state, eventLoop->fired+numevents);
+#endif
+    return numevents;
+}
+
+#ifdef AE_HAVE_RING
+static int aeApiRingCreate(aeEventLoop *eventLoop, int count, int size) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->fallback || state->br) return -1;
+    return aeRingSetup(state, count, size);
+}
+
+static int aeApiRingAttach(aeEventLoop *eventLoop, int fd, int flags) {
+    aeApiState *state = eventLoop->apidata;
+    aeRingFd *r;
+    int slot;
+
+    if (state->fallback || !state->ringok) return -1;
+    /* The slot stays with the fd until it is detached, even once the
+     * loop no longer watches the fd. */
+    if ((slot = aeSlotGet(eventLoop, fd)) == -1) return -1;
+    eventLoop->events[slot].held = 1;
+    r = &state->rfd[slot];
+    aeUringDisarm(state, slot);
+    r->attached = 1;
+    r->copy = flags & AE_RING_COPY;
+    r->head = r->tail = -1;
+    aeRingArmRecv(state, slot, fd);
+    aeRingMarkReady(state, slot);
+    return 0;
+}
+
+/* Must be called before the fd is closed: the recv and send requests hold
+ * the file open until they are cancelled, and queued buffers go back to the
+ * ring. The caller's buffers are not read once the send is cancelled. */
+static void aeApiRingDetach(aeEventLoop *eventLoop, int fd) {
+    aeApiState *state = eventLoop->apidata;
+    int slot = aeSlotOf(eventLoop, fd);
+    aeRingFd *r;
+
+    if (state->fallback || slot == -1) return;
+    r = &state->rfd[slot];
+    if (!r->attached) return;
+
+    if (r->recving)
+        aeUringQueue(state, IORING_OP_ASYNC_CANCEL, -1, 0,
+                aeRingData(state, slot, AE_URING_RECV), AE_URING_REMOVE);
+    if (r->sending)
+        aeUringQueue(state, IORING_OP_ASYNC_CANCEL, -1, 0,
+                aeRingData(state, slot, AE_URING_SEND), AE_URING_REMOVE);
+    while (r->head != -1) {
+        int bid = r->head;
+        r->head = state->bnext[bid];
+        aeRingRecycle(state, bid);
+    }
+    aeRingReset(eventLoop, state, slot);
+}
+
+/* Stop receiving into the ring. Reads keep returning the data received so
+ * far, and once it is consumed and no send is in flight the fd is polled
+ * again and reads and writes fail with EBADF. */
+static void aeApiRingRelease(aeEventLoop *eventLoop, int fd) {
+    aeApiState *state = eventLoop->apidata;
+    int slot = aeSlotOf(eventLoop, fd);
+    aeRingFd *r;
+
+    if (state->fallback || slot == -1) return;
+    r = &state->rfd[slot];
+    if (!r->attached || r->releasing) return;
+
+    r->releasing = 1;
+    if (r->recving)
+        aeUringQueue(state, IORING_OP_ASYNC_CANCEL, -1, 0,
+                aeRingData(state, slot, AE_URING_RECV), AE_URING_REMOVE);
+    aeRingMarkReady(state, slot);
+}
+
+static ssize_t aeApiRingRead(aeEventLoop *eventLoop, int fd, char **buf,
+        size_t max)
+{
+    aeApiState *state = eventLoop->apidata;
+    int slot = aeSlotOf(eventLoop, fd);
+    aeRingFd *r = slot != -1 ? &state->rfd[slot] : NULL;
+    size_t n;
+    int bid;
+
+    aeRingReturnLent(state);
+    if (!r || !r->attached) {
+        errno = EBADF;
+        return -1;
+    }
+    if (r->head == -1) {
+        if (r->error) errno = r->error;
+        else if (!r->eof) errno = EAGAIN;
+        return r->eof && !r->error ? 0 : -1;
+    }
+
+    bid = r->head;
+    n = state->blen[bid] - r->off;
+    if (n > max) n = max;
+    *buf = state->bufs + (size_t)bid*state->bufsize + r->off;
+    r->off += n;
+    r->pending -= n;
+    if (r->off == state->blen[bid]) {
+        r->head = state->bnext[bid];
+        if (r->head == -1) r->tail = -1;
+        r->off = 0;
+        state->lent = bid;
+    }
+    return n;
+}
+
+static size_t aeApiRingPending(aeEventLoop *eventLoop, int fd) {
+    aeApiState *state = eventLoop->apidata;
+    int slot = aeSlotOf(eventLoop, fd);
+
+    return slot != -1 ? state->rfd[slot].pending : 0;
+}
+
+static ssize_t aeApiRingWrite(aeEventLoop *eventLoop, int fd,
+        const struct iovec *iov, int iovcnt)
+{
+    aeApiState *state = eventLoop->apidata;
+    int slot = aeSlotOf(eventLoop, fd);
+    aeRingFd *r = slot != -1 ? &state->rfd[slot] : NULL;
+    size_t len = 0;
+    int j, count;
+
+    if (!r || !r->attached) {
+        errno = EBADF;
+        return -1;
+    }
+    if (r->error) {
+        errno = r->error;
+        return -1;
+    }
+    if (r->sending) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    for (j = 0; j < iovcnt; j++) len += iov[j].iov_len;
+    if (len == 0) return 0;
+
+    count = r->copy ? 1 : iovcnt;
+    if (!r->msg || r->msg->iovsize < count) {
+        aeRingMsg *msg = zrealloc(r->msg, sizeof(*msg)+sizeof(*iov)*count);
+        if (!msg) {
+            errno = ENOMEM;
+            return -1;
+        }
+        r->msg = msg;
+        r->msg->iovsize = count;
+    }
+    if (r->copy) {
+        if (len > r->outsize) {
+            char *out = zrealloc(r->out, len);
+            if (!out) {
+                errno = ENOMEM;
+                return -1;
+            }
+            r->out = out;
+            r->outsize = len;
+        }
+        for (len = 0, j = 0; j < iovcnt; j++) {
+            memcpy(r->out+len, iov[j].iov_base, iov[j].iov_len);
+            len += iov[j].iov_len;
+        }
+        r->msg->iov[0].iov_base = r->out;
+        r->msg->iov[0].iov_len = len;
+    } else {
+        memcpy(r->msg->iov, iov, sizeof(*iov)*count);
+    }
+
+    memset(&r->msg->hdr, 0, sizeof(r->msg->hdr));
+    r->msg->hdr.msg_iov = r->msg->iov;
+    r->msg->hdr.msg_iovlen = count;
+    r->msg->left = len;
+    aeRingSend(state, slot, fd);
+    return len;
+}
+
+static int aeApiRingWriting(aeEventLoop *eventLoop, int fd) {
+    aeApiState *state = eventLoop->apidata;
+    int slot = aeSlotOf(eventLoop, fd);
+
+    if (state->fallback || slot == -1) return 0;
+    return state->rfd[slot].attached && state->rfd[slot].sending;
+}
+#endif
+
+/* The receive buffers are counted, the rings shared with the kernel are
+ * not. */
+static size_t aeApiMemory(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+    size_t size = sizeof(*state);
+    int slot;
+
+    if (state->fallback)
+        return size - sizeof(aeEpollState) + aeEpollMemory(eventLoop);
+
+    size += (size_t)eventLoop->setsize*(sizeof(int)*3 + sizeof(uint32_t) + 2 +
+            sizeof(aeRingFd));
+    size += (size_t)state->nbufs*(state->bufsize + sizeof(int) +
+            sizeof(unsigned));
+    for (slot = 0; slot < state->rfdsize; slot++) {
+        aeRingFd *r = &state->rfd[slot];
+        if (r->msg) size += sizeof(aeRingMsg) + sizeof(struct iovec)*r->msg->iovsize;
+        size += r->outsize;
+    }
+    return size;
+}
+
+/* Every loop falls back to epoll on its own, this names the module. */
+static char *aeApiName(void) {
+    AE_NOTUSED(aeEpollName);
+    return "io_uring";
+}
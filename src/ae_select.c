@@ -48,6 +48,12 @@ static int aeApiCreate(aeEventLoop *eventLoop) {
     return 0;
 }
 
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    /* Just ensure we have enough room in the fd_set type. */
+    if (setsize >= FD_SETSIZE) return -1;
+    return 0;
+}
+
 static void aeApiFree(aeEventLoop *eventLoop) {
     zfree(eventLoop->apidata);
 }
@@ -55,6 +61,7 @@ static void aeApiFree(aeEventLoop *eventLoop) {
 static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
     aeApiState *state = eventLoop->apidata;
 
+    if (fd >= FD_SETSIZE) return -1;
     if (mask & AE_READABLE) FD_SET(fd,&state->rfds);
     if (mask & AE_WRITABLE) FD_SET(fd,&state->wfds);
     return 0;
@@ -77,16 +84,16 @@ static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
     retval = select(eventLoop->maxfd+1,
                 &state->_rfds,&state->_wfds,NULL,tvp);
     if (retval > 0) {
-        for (j = 0; j <= eventLoop->maxfd; j++) {
+        for (j = 0; j < eventLoop->slotCount; j++) {
             int mask = 0;
             aeFileEvent *fe = &eventLoop->events[j];
 
             if (fe->mask == AE_NONE) continue;
-            if (fe->mask & AE_READABLE && FD_ISSET(j,&state->_rfds))
+            if (fe->mask & AE_READABLE && FD_ISSET(fe->fd,&state->_rfds))
                 mask |= AE_READABLE;
-            if (fe->mask & AE_WRITABLE && FD_ISSET(j,&state->_wfds))
+            if (fe->mask & AE_WRITABLE && FD_ISSET(fe->fd,&state->_wfds))
                 mask |= AE_WRITABLE;
-            eventLoop->fired[numevents].fd = j;
+            eventLoop->fired[numevents].fd = fe->fd;
             eventLoop->fired[numevents].mask = mask;
             numevents++;
         }
@@ -94,6 +101,11 @@ static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
     return numevents;
 }
 
+static size_t aeApiMemory(aeEventLoop *eventLoop) {
+    AE_NOTUSED(eventLoop);
+    return sizeof(aeApiState);
+}
+
 static char *aeApiName(void) {
     return "select";
 }
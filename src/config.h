@@ -30,6 +30,11 @@ C99已经加为标准。要兼容老的编译器，还需用#ifdef指令。
 
 #elif defined(__linux__)
 #define HAVE_EPOLL
+#if !defined(NO_IOURING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IOURING
+#endif
+#endif
 #elif defined (__sun)
 #define HAVE_EVPORT
 #define _XPG6
@@ -0,0 +1,136 @@
+// Event boundaries within long-lived streaming responses.
+//
+// Server-Sent Events end at a blank line and only count when they carry a
+// data field, so comments used as keep-alives are skipped. In lines mode,
+// e.g. for NDJSON, every non-empty line is an event. The start of each
+// event is kept only when a timestamp field has to be found in it.
+
+#include <ctype.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "events.h"
+#include "zmalloc.h"
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+
+int events_parse_mode(events *e, char *arg) {
+    if (!strcmp(arg, "sse")) {
+        e->mode = EVENTS_SSE;
+    } else if (!strcmp(arg, "lines")) {
+        e->mode = EVENTS_LINES;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+void events_parse_field(events *e, char *arg) {
+    e->field     = arg;
+    e->field_len = strlen(arg);
+}
+
+static bool line_is_data(event_state *s) {
+    return s->col >= 4 && !memcmp(s->head, "data", 4) && (s->col == 4 || s->head[4] == ':' || s->head[4] == '\r');
+}
+
+static bool line_is_blank(event_state *s) {
+    return s->col == 0 || (s->col == 1 && s->head[0] == '\r');
+}
+
+// Consume body bytes up to and including the end of the next event, with
+// *complete set if one ended. Returns the number of bytes consumed.
+size_t events_next(events *e, event_state *s, const char *data, size_t len, bool *complete) {
+    const char *p = data, *end = data + len;
+
+    *complete = false;
+    if (s->done) {
+        s->text_len = 0;
+        s->done     = false;
+    }
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *stop = nl ? nl + 1 : end;
+        size_t n = stop - p;
+
+        if (s->col < sizeof(s->head)) {
+            memcpy(s->head + s->col, p, MIN(n, sizeof(s->head) - s->col));
+        }
+        if (e->field && s->text_len < EVENTS_TEXT) {
+            if (!s->text) s->text = zmalloc(EVENTS_TEXT);
+            size_t keep = MIN(n, EVENTS_TEXT - s->text_len);
+            memcpy(s->text + s->text_len, p, keep);
+            s->text_len += keep;
+        }
+        s->col += nl ? nl - p : n;
+        p = stop;
+
+        if (!nl) break;
+
+        if (e->mode == EVENTS_LINES || line_is_blank(s)) {
+            *complete = e->mode == EVENTS_LINES ? !line_is_blank(s) : s->data;
+            s->data   = false;
+            if (!*complete) s->text_len = 0;
+        } else {
+            s->data |= line_is_data(s);
+        }
+        s->col = 0;
+
+        if (*complete) {
+            s->done = true;
+            break;
+        }
+    }
+
+    return p - data;
+}
+
+// Find the number following the timestamp field in the event just ended,
+// e.g. ts: 1700000000123 or "ts":1700000000.123, as microseconds since
+// the epoch. Seconds, milliseconds, microseconds and nanoseconds are told
+// apart by their magnitude.
+bool events_time(events *e, event_state *s, uint64_t *time) {
+    const char *p = s->text, *end = s->text + s->text_len;
+    size_t n = e->field_len;
+
+    for (; p && end - p > (ssize_t) n; p++) {
+        if (memcmp(p, e->field, n)) continue;
+        if (p > s->text && (isalnum((unsigned char) p[-1]) || p[-1] == '_')) continue;
+
+        const char *v = p + n;
+        while (v < end && *v && strchr("\"': =\t", *v)) v++;
+        if (v == end || !isdigit((unsigned char) *v)) continue;
+
+        uint64_t whole = 0, frac = 0, scale = 1;
+        int digits = 0;
+        for (; v < end && isdigit((unsigned char) *v); v++, digits++) whole = whole * 10 + *v - '0';
+        if (v < end && *v == '.') {
+            for (v++; v < end && isdigit((unsigned char) *v) && scale < 1000000; v++) {
+                frac = frac * 10 + *v - '0';
+                scale *= 10;
+            }
+            *time = whole * 1000000 + frac * (1000000 / scale);
+        } else if (digits <= 10) {
+            *time = whole * 1000000;
+        } else if (digits <= 13) {
+            *time = whole * 1000;
+        } else if (digits <= 16) {
+            *time = whole;
+        } else {
+            *time = whole / 1000;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+void events_reset(event_state *s) {
+    s->col      = 0;
+    s->data     = false;
+    s->text_len = 0;
+    s->done     = false;
+    s->count    = 0;
+    s->last     = 0;
+}
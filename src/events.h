@@ -0,0 +1,36 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define EVENTS_TEXT 512
+
+typedef struct {
+    enum {
+        EVENTS_NONE, EVENTS_SSE, EVENTS_LINES
+    } mode;
+    char  *field;
+    size_t field_len;
+} events;
+
+typedef struct {
+    size_t   col;
+    char     head[5];
+    bool     data;
+    size_t   text_len;
+    char    *text;
+    bool     done;
+    uint64_t count;
+    uint64_t last;
+} event_state;
+
+int events_parse_mode(events *, char *);
+void events_parse_field(events *, char *);
+
+size_t events_next(events *, event_state *, const char *, size_t, bool *);
+bool events_time(events *, event_state *, uint64_t *);
+void events_reset(event_state *);
+
+#endif /* EVENTS_H */
@@ -0,0 +1,177 @@
+// Response checks that run in C on the receive buffer, so that validating
+// responses does not need a Lua response() function.
+//
+// The body is streamed through CRC-32 as it arrives and only a short
+// prefix is copied, for --expect-body and --expect-regex.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "expect.h"
+#include "zmalloc.h"
+
+static uint32_t crc32_table[8][256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc32_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t c = crc32_table[t - 1][i];
+            crc32_table[t][i] = crc32_table[0][c & 0xff] ^ (c >> 8);
+        }
+    }
+}
+
+// CRC-32 as used by zlib and gzip, eight bytes at a time.
+uint32_t crc32_update(uint32_t crc, const char *data, size_t len) {
+    const uint8_t *p = (const uint8_t *) data;
+
+    crc = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t a = crc ^ ((uint32_t) p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+        crc = crc32_table[7][a & 0xff] ^ crc32_table[6][(a >> 8) & 0xff] ^
+              crc32_table[5][(a >> 16) & 0xff] ^ crc32_table[4][a >> 24] ^
+              crc32_table[3][p[4]] ^ crc32_table[2][p[5]] ^
+              crc32_table[1][p[6]] ^ crc32_table[0][p[7]];
+    }
+    while (len--) crc = crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+void expect_init(expect *e) {
+    memset(e, 0, sizeof(*e));
+    e->length = -1;
+    pthread_once(&crc32_once, crc32_init);
+}
+
+// A comma separated list of codes, where x matches any digit as in 2xx.
+int expect_parse_status(expect *e, char *arg) {
+    char *s = arg;
+
+    do {
+        int lo = 0, hi = 0;
+        for (int i = 0; i < 3; i++, s++) {
+            if (*s >= '0' && *s <= '9') {
+                lo = lo * 10 + *s - '0';
+                hi = hi * 10 + *s - '0';
+            } else if ((*s == 'x' || *s == 'X') && i > 0) {
+                lo = lo * 10;
+                hi = hi * 10 + 9;
+            } else {
+                return -1;
+            }
+        }
+        if (lo < 100 || hi > 599 || (*s && *s != ',')) return -1;
+        for (int i = lo; i <= hi; i++) e->status[i] = true;
+    } while (*s++ == ',');
+
+    e->any_status = true;
+    return 0;
+}
+
+int expect_parse_length(expect *e, char *arg) {
+    char *end;
+    long long n = strtoll(arg, &end, 10);
+    if (*arg < '0' || *arg > '9' || *end) return -1;
+    e->length = n;
+    e->body   = true;
+    return 0;
+}
+
+int expect_parse_crc32(expect *e, char *arg) {
+    char *end;
+    if (!strncmp(arg, "0x", 2) || !strncmp(arg, "0X", 2)) arg += 2;
+    unsigned long n = strtoul(arg, &end, 16);
+    if (!*arg || *end || strlen(arg) > 8) return -1;
+    e->crc32     = n;
+    e->any_crc32 = true;
+    e->body      = true;
+    return 0;
+}
+
+int expect_parse_body(expect *e, char *arg) {
+    e->substring     = arg;
+    e->substring_len = strlen(arg);
+    e->prefix        = EXPECT_PREFIX;
+    e->body          = true;
+    return e->substring_len > EXPECT_PREFIX ? -1 : 0;
+}
+
+int expect_parse_regex(expect *e, char *arg) {
+    if (regcomp(&e->regex, arg, REG_EXTENDED | REG_NOSUB)) return -1;
+    e->any_regex = true;
+    e->prefix    = EXPECT_PREFIX;
+    e->body      = true;
+    return 0;
+}
+
+bool expect_any(expect *e) {
+    return e->any_status || e->body;
+}
+
+void expect_body(expect *e, expect_state *s, const char *data, size_t len) {
+    s->length += len;
+    if (e->any_crc32) s->crc32 = crc32_update(s->crc32, data, len);
+
+    if (s->prefix_len < e->prefix) {
+        size_t n = MIN(len, e->prefix - s->prefix_len);
+        if (!s->prefix) s->prefix = zmalloc(e->prefix + 1);
+        memcpy(s->prefix + s->prefix_len, data, n);
+        s->prefix_len += n;
+    }
+}
+
+static bool contains(const char *s, size_t len, const char *sub, size_t sub_len) {
+    const char *end = s + len;
+
+    if (sub_len == 0) return true;
+    while (end - s >= (ssize_t) sub_len && (s = memchr(s, sub[0], end - s - sub_len + 1))) {
+        if (!memcmp(s, sub, sub_len)) return true;
+        s++;
+    }
+    return false;
+}
+
+// Check a complete response and count each kind of mismatch once, then
+// reset the state for the next response.
+void expect_check(expect *e, expect_state *s, int status, errors *errors) {
+    if (e->any_status && (status < 100 || status > 599 || !e->status[status])) {
+        errors->mismatch.status++;
+    }
+
+    if (e->length >= 0 && s->length != (uint64_t) e->length) {
+        errors->mismatch.length++;
+    }
+
+    if (e->any_crc32 && s->crc32 != e->crc32) {
+        errors->mismatch.crc32++;
+    }
+
+    if (e->prefix) {
+        bool match = true;
+        if (s->prefix) s->prefix[s->prefix_len] = '\0';
+        if (e->substring) {
+            match = contains(s->prefix, s->prefix_len, e->substring, e->substring_len);
+        }
+        if (match && e->any_regex) {
+            match = !regexec(&e->regex, s->prefix ? s->prefix : "", 0, NULL, 0);
+        }
+        if (!match) errors->mismatch.body++;
+    }
+
+    expect_reset(s);
+}
+
+void expect_reset(expect_state *s) {
+    s->length     = 0;
+    s->crc32      = 0;
+    s->prefix_len = 0;
+}
@@ -0,0 +1,48 @@
+#ifndef EXPECT_H
+#define EXPECT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <regex.h>
+
+#include "stats.h"
+
+#define EXPECT_PREFIX 4096
+
+typedef struct {
+    bool     status[600];
+    bool     any_status;
+    int64_t  length;
+    bool     any_crc32;
+    uint32_t crc32;
+    char    *substring;
+    size_t   substring_len;
+    bool     any_regex;
+    regex_t  regex;
+    bool     body;
+    size_t   prefix;
+} expect;
+
+typedef struct {
+    uint64_t length;
+    uint32_t crc32;
+    size_t   prefix_len;
+    char    *prefix;
+} expect_state;
+
+void expect_init(expect *);
+int expect_parse_status(expect *, char *);
+int expect_parse_length(expect *, char *);
+int expect_parse_crc32(expect *, char *);
+int expect_parse_body(expect *, char *);
+int expect_parse_regex(expect *, char *);
+bool expect_any(expect *);
+
+void expect_body(expect *, expect_state *, const char *, size_t);
+void expect_check(expect *, expect_state *, int, errors *);
+void expect_reset(expect_state *);
+
+uint32_t crc32_update(uint32_t, const char *, size_t);
+
+#endif /* EXPECT_H */
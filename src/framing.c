@@ -0,0 +1,274 @@
+// Response framing for non-HTTP protocols over TCP.
+//
+// A response is a fixed number of bytes, a length-prefixed frame, bytes
+// up to a delimiter, or one complete Redis RESP value. Only boundaries are
+// found, so payload bytes are skipped without being examined, apart from
+// RESP type lines and the error flag they carry.
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framing.h"
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+
+// Decode C style escapes: \r \n \t \0 \\ and \xHH.
+static int parse_delim(framing *f, const char *s) {
+    size_t n = 0;
+
+    for (; *s; s++) {
+        char c = *s;
+        if (n == FRAMING_DELIM_MAX) return -1;
+        if (c == '\\') {
+            switch (*++s) {
+                case 'r':  c = '\r'; break;
+                case 'n':  c = '\n'; break;
+                case 't':  c = '\t'; break;
+                case '0':  c = '\0'; break;
+                case '\\': c = '\\'; break;
+                case 'x':
+                    if (!isxdigit((unsigned char) s[1]) || !isxdigit((unsigned char) s[2])) return -1;
+                    char hex[3] = { s[1], s[2], '\0' };
+                    c = (char) strtol(hex, NULL, 16);
+                    s += 2;
+                    break;
+                default:
+                    return -1;
+            }
+        }
+        f->delim[n++] = c;
+    }
+    if (!n) return -1;
+    f->delim_len = n;
+
+    // KMP failure function, so a delimiter split across reads is found
+    // without looking back at earlier buffers
+    f->fail[0] = 0;
+    for (size_t i = 1, k = 0; i < n; i++) {
+        while (k && f->delim[i] != f->delim[k]) k = f->fail[k - 1];
+        if (f->delim[i] == f->delim[k]) k++;
+        f->fail[i] = k;
+    }
+
+    return 0;
+}
+
+static int parse_uint(const char *s, char **end, uint64_t *n) {
+    if (!isdigit((unsigned char) *s)) return -1;
+    *n = strtoull(s, end, 10);
+    return 0;
+}
+
+// length:OFF:WIDTH[:be|le][:ADJ] reads a WIDTH byte length at offset OFF,
+// the frame being OFF + WIDTH + length + ADJ bytes long in total.
+static int parse_length(framing *f, const char *s) {
+    uint64_t offset, width;
+    char *end;
+
+    if (parse_uint(s, &end, &offset) || *end != ':') return -1;
+    if (parse_uint(end + 1, &end, &width)) return -1;
+    if (width != 1 && width != 2 && width != 4 && width != 8) return -1;
+    if (offset + width > FRAMING_HEADER) return -1;
+
+    f->offset = offset;
+    f->width  = width;
+
+    if (*end == ':' && (!strncmp(end + 1, "be", 2) || !strncmp(end + 1, "le", 2))) {
+        f->little = end[1] == 'l';
+        end += 3;
+    }
+    if (*end == ':') {
+        f->adjust = strtoll(end + 1, &end, 10);
+    }
+
+    return *end ? -1 : 0;
+}
+
+int framing_parse(framing *f, const char *desc) {
+    char *end;
+
+    memset(f, 0, sizeof(*f));
+
+    if (!strncmp(desc, "fixed:", 6)) {
+        f->type = FRAMING_FIXED;
+        return parse_uint(desc + 6, &end, &f->size) || *end || !f->size ? -1 : 0;
+    } else if (!strncmp(desc, "length:", 7)) {
+        f->type = FRAMING_LENGTH;
+        return parse_length(f, desc + 7);
+    } else if (!strncmp(desc, "delim:", 6)) {
+        f->type = FRAMING_DELIM;
+        return parse_delim(f, desc + 6);
+    } else if (!strcmp(desc, "resp")) {
+        f->type = FRAMING_RESP;
+        return 0;
+    }
+
+    return -1;
+}
+
+void framing_init(framing *f, framing_state *s) {
+    s->remaining = f->type == FRAMING_FIXED ? f->size : 0;
+    s->have      = 0;
+    s->body      = false;
+    s->pending   = 1;
+    s->error     = false;
+    s->line_len  = 0;
+    s->done      = false;
+}
+
+static size_t skip(framing_state *s, const char *data, size_t len) {
+    size_t n = MIN(s->remaining, (uint64_t) len);
+    s->remaining -= n;
+    return n;
+}
+
+static size_t execute_length(framing *f, framing_state *s, const char *data, size_t len, framing_result *result) {
+    size_t head = f->offset + f->width, n;
+
+    if (!s->body) {
+        n = MIN(head - s->have, len);
+        memcpy(s->header + s->have, data, n);
+        if ((s->have += n) < head) return n;
+
+        uint64_t value = 0;
+        for (size_t i = 0; i < f->width; i++) {
+            uint8_t b = s->header[f->offset + (f->little ? f->width - 1 - i : i)];
+            value = value << 8 | b;
+        }
+        int64_t rest = (int64_t) value + f->adjust;
+        if (rest < 0) {
+            *result = FRAMING_ERROR;
+            return n;
+        }
+        s->remaining = rest;
+        s->body = true;
+    } else {
+        n = 0;
+    }
+
+    n += skip(s, data + n, len - n);
+    if (!s->remaining) *result = FRAMING_COMPLETE;
+    return n;
+}
+
+static size_t execute_delim(framing *f, framing_state *s, const char *data, size_t len, framing_result *result) {
+    const char *p = data, *end = data + len;
+    size_t k = s->have;
+
+    while (p < end) {
+        if (k == 0 && !(p = memchr(p, f->delim[0], end - p))) return len;
+        while (k && *p != f->delim[k]) k = f->fail[k - 1];
+        if (*p++ == f->delim[k]) k++;
+        if (k == f->delim_len) {
+            *result = FRAMING_COMPLETE;
+            return p - data;
+        }
+    }
+
+    s->have = k;
+    return len;
+}
+
+// One RESP line has ended: count down the values still to come, adding
+// the elements of any aggregate and skipping the payload of bulk strings.
+static int resp_line(framing_state *s) {
+    char type = s->line[0];
+    char *end;
+
+    s->line[MIN(s->line_len, FRAMING_LINE - 1)] = '\0';
+    long long n = strtoll(s->line + 1, &end, 10);
+    s->line_len = 0;
+    s->pending--;
+
+    switch (type) {
+        case '-':
+            s->error = true;
+            break;
+        case '!':
+            s->error = true;
+            // fall through
+        case '$': case '=':
+            if (end == s->line + 1) return -1;
+            if (n >= 0) {
+                s->remaining = n + 2;
+                s->pending++;
+                s->body = true;
+            }
+            break;
+        case '*': case '~': case '>': case '%': case '|':
+            if (end == s->line + 1) return -1;
+            if (n > 0) s->pending += type == '%' || type == '|' ? 2 * n : n;
+            break;
+        case '+': case ':': case '_': case '#': case ',': case '(':
+            break;
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+static size_t execute_resp(framing_state *s, const char *data, size_t len, framing_result *result) {
+    const char *p = data, *end = data + len;
+
+    while (p < end) {
+        if (s->body) {
+            p += skip(s, p, end - p);
+            if (s->remaining) break;
+            s->body = false;
+            s->pending--;
+        } else {
+            const char *nl = memchr(p, '\n', end - p);
+            const char *stop = nl ? nl : end;
+            size_t n = MIN((size_t) (stop - p), FRAMING_LINE - 1 - MIN(s->line_len, FRAMING_LINE - 1));
+            memcpy(s->line + s->line_len, p, n);
+            s->line_len += n;
+            p = nl ? nl + 1 : end;
+            if (!nl) break;
+            if (!s->line_len || resp_line(s)) {
+                *result = FRAMING_ERROR;
+                return p - data;
+            }
+        }
+
+        if (!s->pending) {
+            *result = FRAMING_COMPLETE;
+            return p - data;
+        }
+    }
+
+    return p - data;
+}
+
+// Consume bytes up to the end of the current response, with *result set to
+// FRAMING_COMPLETE if it ended. A completed response resets the state for
+// the next one, except for the error flag which the caller reads first.
+size_t framing_execute(framing *f, framing_state *s, const char *data, size_t len, framing_result *result) {
+    size_t n = 0;
+
+    if (s->done) framing_init(f, s);
+    *result = FRAMING_MORE;
+
+    switch (f->type) {
+        case FRAMING_FIXED:
+            n = skip(s, data, len);
+            if (!s->remaining) *result = FRAMING_COMPLETE;
+            break;
+        case FRAMING_LENGTH:
+            n = execute_length(f, s, data, len, result);
+            break;
+        case FRAMING_DELIM:
+            n = execute_delim(f, s, data, len, result);
+            break;
+        case FRAMING_RESP:
+            n = execute_resp(s, data, len, result);
+            break;
+        case FRAMING_NONE:
+            *result = FRAMING_ERROR;
+            break;
+    }
+
+    s->done = *result == FRAMING_COMPLETE;
+    return n;
+}
@@ -0,0 +1,50 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAMING_HEADER    64
+#define FRAMING_DELIM_MAX 64
+#define FRAMING_LINE      32
+
+typedef enum {
+    FRAMING_MORE,
+    FRAMING_COMPLETE,
+    FRAMING_ERROR
+} framing_result;
+
+// How responses of a non-HTTP protocol are delimited, from a descriptor
+// such as fixed:16, length:0:4, delim:\r\n or resp.
+typedef struct {
+    enum {
+        FRAMING_NONE, FRAMING_FIXED, FRAMING_LENGTH, FRAMING_DELIM, FRAMING_RESP
+    } type;
+    uint64_t size;
+    size_t   offset;
+    size_t   width;
+    bool     little;
+    int64_t  adjust;
+    char     delim[FRAMING_DELIM_MAX];
+    size_t   delim_len;
+    size_t   fail[FRAMING_DELIM_MAX];
+} framing;
+
+typedef struct {
+    uint64_t remaining;
+    size_t   have;
+    uint8_t  header[FRAMING_HEADER];
+    bool     body;
+    int64_t  pending;
+    bool     error;
+    char     line[FRAMING_LINE];
+    size_t   line_len;
+    bool     done;
+} framing_state;
+
+int framing_parse(framing *, const char *);
+void framing_init(framing *, framing_state *);
+size_t framing_execute(framing *, framing_state *, const char *, size_t, framing_result *);
+
+#endif /* FRAMING_H */
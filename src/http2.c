@@ -0,0 +1,1015 @@
+// HTTP/2 client framing and HPACK, RFC 7540 and RFC 7541.
+//
+// Like http_parser this does no I/O: received bytes are fed to
+// http2_execute() and frames to send accumulate in an output buffer that
+// the caller drains with http2_output() and http2_consume().
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http2.h"
+#include "http_parser.h"
+#include "zmalloc.h"
+
+#define FRAME_DATA           0x0
+#define FRAME_HEADERS        0x1
+#define FRAME_RST_STREAM     0x3
+#define FRAME_SETTINGS       0x4
+#define FRAME_PUSH_PROMISE   0x5
+#define FRAME_PING           0x6
+#define FRAME_GOAWAY         0x7
+#define FRAME_WINDOW_UPDATE  0x8
+#define FRAME_CONTINUATION   0x9
+
+#define FLAG_END_STREAM      0x01
+#define FLAG_ACK             0x01
+#define FLAG_END_HEADERS     0x04
+#define FLAG_PADDED          0x08
+#define FLAG_PRIORITY        0x20
+
+#define SETTINGS_HEADER_TABLE_SIZE       0x1
+#define SETTINGS_ENABLE_PUSH             0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS  0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE     0x4
+#define SETTINGS_MAX_FRAME_SIZE          0x5
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+
+#define DEFAULT_WINDOW       65535
+#define MAX_STREAM_ID        0x7fffffff
+#define TABLE_ENTRIES        (HTTP2_TABLE_SIZE / 32)
+
+static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+typedef struct {
+    char  *data;
+    size_t len;
+    size_t cap;
+} bytes;
+
+typedef struct {
+    char  *name;
+    size_t name_len;
+    char  *value;
+    size_t value_len;
+} entry;
+
+typedef struct {
+    uint32_t id;
+    int64_t  window;
+    char    *body;
+    size_t   body_len;
+    size_t   sent;
+    bool     sending;
+    uint32_t consumed;
+} stream;
+
+struct http2 {
+    void *data;
+    const http2_settings *settings;
+    stream  *streams;
+    size_t   limit;
+    size_t   active;
+    uint32_t next_id;
+    uint32_t peer_streams;
+    uint32_t peer_window;
+    uint32_t peer_frame;
+    int64_t  window;
+    uint32_t consumed;
+    bool     goaway;
+
+    bytes    in;
+    bytes    out;
+    size_t   out_sent;
+
+    bytes    block;
+    uint32_t block_stream;
+    uint8_t  block_flags;
+    bool     in_block;
+    bool     interim;
+
+    bytes    name;
+    bytes    value;
+
+    struct {
+        entry  entries[TABLE_ENTRIES];
+        size_t first;
+        size_t count;
+        size_t size;
+        size_t max;
+    } table;
+};
+
+static const struct {
+    char *name;
+    char *value;
+} static_table[] = {
+    { ":authority",                  ""              },
+    { ":method",                     "GET"           },
+    { ":method",                     "POST"          },
+    { ":path",                       "/"             },
+    { ":path",                       "/index.html"   },
+    { ":scheme",                     "http"          },
+    { ":scheme",                     "https"         },
+    { ":status",                     "200"           },
+    { ":status",                     "204"           },
+    { ":status",                     "206"           },
+    { ":status",                     "304"           },
+    { ":status",                     "400"           },
+    { ":status",                     "404"           },
+    { ":status",                     "500"           },
+    { "accept-charset",              ""              },
+    { "accept-encoding",             "gzip, deflate" },
+    { "accept-language",             ""              },
+    { "accept-ranges",               ""              },
+    { "accept",                      ""              },
+    { "access-control-allow-origin", ""              },
+    { "age",                         ""              },
+    { "allow",                       ""              },
+    { "authorization",               ""              },
+    { "cache-control",               ""              },
+    { "content-disposition",         ""              },
+    { "content-encoding",            ""              },
+    { "content-language",            ""              },
+    { "content-length",              ""              },
+    { "content-location",            ""              },
+    { "content-range",               ""              },
+    { "content-type",                ""              },
+    { "cookie",                      ""              },
+    { "date",                        ""              },
+    { "etag",                        ""              },
+    { "expect",                      ""              },
+    { "expires",                     ""              },
+    { "from",                        ""              },
+    { "host",                        ""              },
+    { "if-match",                    ""              },
+    { "if-modified-since",           ""              },
+    { "if-none-match",               ""              },
+    { "if-range",                    ""              },
+    { "if-unmodified-since",         ""              },
+    { "last-modified",               ""              },
+    { "link",                        ""              },
+    { "location",                    ""              },
+    { "max-forwards",                ""              },
+    { "proxy-authenticate",          ""              },
+    { "proxy-authorization",         ""              },
+    { "range",                       ""              },
+    { "referer",                     ""              },
+    { "refresh",                     ""              },
+    { "retry-after",                 ""              },
+    { "server",                      ""              },
+    { "set-cookie",                  ""              },
+    { "strict-transport-security",   ""              },
+    { "transfer-encoding",           ""              },
+    { "user-agent",                  ""              },
+    { "vary",                        ""              },
+    { "via",                         ""              },
+    { "www-authenticate",            ""              },
+};
+
+#define STATIC_ENTRIES (sizeof(static_table) / sizeof(static_table[0]))
+
+// Huffman code from RFC 7541 Appendix B, indexed by symbol. 256 is EOS.
+static const struct {
+    uint32_t code;
+    uint8_t  bits;
+} huffman[257] = {
+    { 0x00001ff8, 13 }, { 0x007fffd8, 23 }, { 0x0fffffe2, 28 }, { 0x0fffffe3, 28 },
+    { 0x0fffffe4, 28 }, { 0x0fffffe5, 28 }, { 0x0fffffe6, 28 }, { 0x0fffffe7, 28 },
+    { 0x0fffffe8, 28 }, { 0x00ffffea, 24 }, { 0x3ffffffc, 30 }, { 0x0fffffe9, 28 },
+    { 0x0fffffea, 28 }, { 0x3ffffffd, 30 }, { 0x0fffffeb, 28 }, { 0x0fffffec, 28 },
+    { 0x0fffffed, 28 }, { 0x0fffffee, 28 }, { 0x0fffffef, 28 }, { 0x0ffffff0, 28 },
+    { 0x0ffffff1, 28 }, { 0x0ffffff2, 28 }, { 0x3ffffffe, 30 }, { 0x0ffffff3, 28 },
+    { 0x0ffffff4, 28 }, { 0x0ffffff5, 28 }, { 0x0ffffff6, 28 }, { 0x0ffffff7, 28 },
+    { 0x0ffffff8, 28 }, { 0x0ffffff9, 28 }, { 0x0ffffffa, 28 }, { 0x0ffffffb, 28 },
+    { 0x00000014,  6 }, { 0x000003f8, 10 }, { 0x000003f9, 10 }, { 0x00000ffa, 12 },
+    { 0x00001ff9, 13 }, { 0x00000015,  6 }, { 0x000000f8,  8 }, { 0x000007fa, 11 },
+    { 0x000003fa, 10 }, { 0x000003fb, 10 }, { 0x000000f9,  8 }, { 0x000007fb, 11 },
+    { 0x000000fa,  8 }, { 0x00000016,  6 }, { 0x00000017,  6 }, { 0x00000018,  6 },
+    { 0x00000000,  5 }, { 0x00000001,  5 }, { 0x00000002,  5 }, { 0x00000019,  6 },
+    { 0x0000001a,  6 }, { 0x0000001b,  6 }, { 0x0000001c,  6 }, { 0x0000001d,  6 },
+    { 0x0000001e,  6 }, { 0x0000001f,  6 }, { 0x0000005c,  7 }, { 0x000000fb,  8 },
+    { 0x00007ffc, 15 }, { 0x00000020,  6 }, { 0x00000ffb, 12 }, { 0x000003fc, 10 },
+    { 0x00001ffa, 13 }, { 0x00000021,  6 }, { 0x0000005d,  7 }, { 0x0000005e,  7 },
+    { 0x0000005f,  7 }, { 0x00000060,  7 }, { 0x00000061,  7 }, { 0x00000062,  7 },
+    { 0x00000063,  7 }, { 0x00000064,  7 }, { 0x00000065,  7 }, { 0x00000066,  7 },
+    { 0x00000067,  7 }, { 0x00000068,  7 }, { 0x00000069,  7 }, { 0x0000006a,  7 },
+    { 0x0000006b,  7 }, { 0x0000006c,  7 }, { 0x0000006d,  7 }, { 0x0000006e,  7 },
+    { 0x0000006f,  7 }, { 0x00000070,  7 }, { 0x00000071,  7 }, { 0x00000072,  7 },
+    { 0x000000fc,  8 }, { 0x00000073,  7 }, { 0x000000fd,  8 }, { 0x00001ffb, 13 },
+    { 0x0007fff0, 19 }, { 0x00001ffc, 13 }, { 0x00003ffc, 14 }, { 0x00000022,  6 },
+    { 0x00007ffd, 15 }, { 0x00000003,  5 }, { 0x00000023,  6 }, { 0x00000004,  5 },
+    { 0x00000024,  6 }, { 0x00000005,  5 }, { 0x00000025,  6 }, { 0x00000026,  6 },
+    { 0x00000027,  6 }, { 0x00000006,  5 }, { 0x00000074,  7 }, { 0x00000075,  7 },
+    { 0x00000028,  6 }, { 0x00000029,  6 }, { 0x0000002a,  6 }, { 0x00000007,  5 },
+    { 0x0000002b,  6 }, { 0x00000076,  7 }, { 0x0000002c,  6 }, { 0x00000008,  5 },
+    { 0x00000009,  5 }, { 0x0000002d,  6 }, { 0x00000077,  7 }, { 0x00000078,  7 },
+    { 0x00000079,  7 }, { 0x0000007a,  7 }, { 0x0000007b,  7 }, { 0x00007ffe, 15 },
+    { 0x000007fc, 11 }, { 0x00003ffd, 14 }, { 0x00001ffd, 13 }, { 0x0ffffffc, 28 },
+    { 0x000fffe6, 20 }, { 0x003fffd2, 22 }, { 0x000fffe7, 20 }, { 0x000fffe8, 20 },
+    { 0x003fffd3, 22 }, { 0x003fffd4, 22 }, { 0x003fffd5, 22 }, { 0x007fffd9, 23 },
+    { 0x003fffd6, 22 }, { 0x007fffda, 23 }, { 0x007fffdb, 23 }, { 0x007fffdc, 23 },
+    { 0x007fffdd, 23 }, { 0x007fffde, 23 }, { 0x00ffffeb, 24 }, { 0x007fffdf, 23 },
+    { 0x00ffffec, 24 }, { 0x00ffffed, 24 }, { 0x003fffd7, 22 }, { 0x007fffe0, 23 },
+    { 0x00ffffee, 24 }, { 0x007fffe1, 23 }, { 0x007fffe2, 23 }, { 0x007fffe3, 23 },
+    { 0x007fffe4, 23 }, { 0x001fffdc, 21 }, { 0x003fffd8, 22 }, { 0x007fffe5, 23 },
+    { 0x003fffd9, 22 }, { 0x007fffe6, 23 }, { 0x007fffe7, 23 }, { 0x00ffffef, 24 },
+    { 0x003fffda, 22 }, { 0x001fffdd, 21 }, { 0x000fffe9, 20 }, { 0x003fffdb, 22 },
+    { 0x003fffdc, 22 }, { 0x007fffe8, 23 }, { 0x007fffe9, 23 }, { 0x001fffde, 21 },
+    { 0x007fffea, 23 }, { 0x003fffdd, 22 }, { 0x003fffde, 22 }, { 0x00fffff0, 24 },
+    { 0x001fffdf, 21 }, { 0x003fffdf, 22 }, { 0x007fffeb, 23 }, { 0x007fffec, 23 },
+    { 0x001fffe0, 21 }, { 0x001fffe1, 21 }, { 0x003fffe0, 22 }, { 0x001fffe2, 21 },
+    { 0x007fffed, 23 }, { 0x003fffe1, 22 }, { 0x007fffee, 23 }, { 0x007fffef, 23 },
+    { 0x000fffea, 20 }, { 0x003fffe2, 22 }, { 0x003fffe3, 22 }, { 0x003fffe4, 22 },
+    { 0x007ffff0, 23 }, { 0x003fffe5, 22 }, { 0x003fffe6, 22 }, { 0x007ffff1, 23 },
+    { 0x03ffffe0, 26 }, { 0x03ffffe1, 26 }, { 0x000fffeb, 20 }, { 0x0007fff1, 19 },
+    { 0x003fffe7, 22 }, { 0x007ffff2, 23 }, { 0x003fffe8, 22 }, { 0x01ffffec, 25 },
+    { 0x03ffffe2, 26 }, { 0x03ffffe3, 26 }, { 0x03ffffe4, 26 }, { 0x07ffffde, 27 },
+    { 0x07ffffdf, 27 }, { 0x03ffffe5, 26 }, { 0x00fffff1, 24 }, { 0x01ffffed, 25 },
+    { 0x0007fff2, 19 }, { 0x001fffe3, 21 }, { 0x03ffffe6, 26 }, { 0x07ffffe0, 27 },
+    { 0x07ffffe1, 27 }, { 0x03ffffe7, 26 }, { 0x07ffffe2, 27 }, { 0x00fffff2, 24 },
+    { 0x001fffe4, 21 }, { 0x001fffe5, 21 }, { 0x03ffffe8, 26 }, { 0x03ffffe9, 26 },
+    { 0x0ffffffd, 28 }, { 0x07ffffe3, 27 }, { 0x07ffffe4, 27 }, { 0x07ffffe5, 27 },
+    { 0x000fffec, 20 }, { 0x00fffff3, 24 }, { 0x000fffed, 20 }, { 0x001fffe6, 21 },
+    { 0x003fffe9, 22 }, { 0x001fffe7, 21 }, { 0x001fffe8, 21 }, { 0x007ffff3, 23 },
+    { 0x003fffea, 22 }, { 0x003fffeb, 22 }, { 0x01ffffee, 25 }, { 0x01ffffef, 25 },
+    { 0x00fffff4, 24 }, { 0x00fffff5, 24 }, { 0x03ffffea, 26 }, { 0x007ffff4, 23 },
+    { 0x03ffffeb, 26 }, { 0x07ffffe6, 27 }, { 0x03ffffec, 26 }, { 0x03ffffed, 26 },
+    { 0x07ffffe7, 27 }, { 0x07ffffe8, 27 }, { 0x07ffffe9, 27 }, { 0x07ffffea, 27 },
+    { 0x07ffffeb, 27 }, { 0x0ffffffe, 28 }, { 0x07ffffec, 27 }, { 0x07ffffed, 27 },
+    { 0x07ffffee, 27 }, { 0x07ffffef, 27 }, { 0x07fffff0, 27 }, { 0x03ffffee, 26 },
+    { 0x3fffffff, 30 },
+};
+
+// Decoding tree built from the code table, each node holds the index of its
+// two children or, for leaves, -1 - symbol.
+static int16_t huffman_tree[512][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_build() {
+    int16_t nodes = 1;
+    for (int sym = 0; sym < 257; sym++) {
+        int16_t node = 0;
+        for (int i = huffman[sym].bits - 1; i >= 0; i--) {
+            int bit = (huffman[sym].code >> i) & 1;
+            if (i == 0) {
+                huffman_tree[node][bit] = -1 - sym;
+            } else {
+                if (!huffman_tree[node][bit]) huffman_tree[node][bit] = nodes++;
+                node = huffman_tree[node][bit];
+            }
+        }
+    }
+}
+
+static void bytes_reserve(bytes *b, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap  = (b->len + len) * 2;
+        b->data = zrealloc(b->data, b->cap);
+    }
+}
+
+static void bytes_append(bytes *b, const void *data, size_t len) {
+    bytes_reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void bytes_byte(bytes *b, uint8_t c) {
+    bytes_append(b, &c, 1);
+}
+
+static void bytes_free(bytes *b) {
+    zfree(b->data);
+    *b = (bytes) { 0 };
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// HPACK
+
+static void hpack_put_int(bytes *b, uint8_t prefix, int bits, uint32_t v) {
+    uint32_t max = (1 << bits) - 1;
+    if (v < max) {
+        bytes_byte(b, prefix | v);
+        return;
+    }
+    bytes_byte(b, prefix | max);
+    for (v -= max; v >= 128; v >>= 7) bytes_byte(b, (v & 0x7f) | 0x80);
+    bytes_byte(b, v);
+}
+
+static void hpack_put_string(bytes *b, const char *s, size_t len) {
+    hpack_put_int(b, 0x00, 7, len);
+    bytes_append(b, s, len);
+}
+
+// Encode one header as indexed when the static table holds the exact pair,
+// otherwise as a literal without indexing, referencing a static name.
+static void hpack_put_header(bytes *b, const char *name, size_t name_len, const char *value, size_t value_len) {
+    size_t index = 0;
+    for (size_t i = 0; i < STATIC_ENTRIES; i++) {
+        if (strlen(static_table[i].name) != name_len) continue;
+        if (memcmp(static_table[i].name, name, name_len)) continue;
+        if (strlen(static_table[i].value) == value_len && !memcmp(static_table[i].value, value, value_len)) {
+            hpack_put_int(b, 0x80, 7, i + 1);
+            return;
+        }
+        if (!index) index = i + 1;
+    }
+
+    hpack_put_int(b, 0x00, 4, index);
+    if (!index) hpack_put_string(b, name, name_len);
+    hpack_put_string(b, value, value_len);
+}
+
+static int hpack_int(const uint8_t **p, const uint8_t *end, int bits, uint32_t *v) {
+    uint32_t max = (1 << bits) - 1;
+    uint8_t b;
+    int m = 0;
+
+    if (*p >= end) return -1;
+    if ((*v = *(*p)++ & max) < max) return 0;
+
+    do {
+        if (*p >= end || m > 21) return -1;
+        b = *(*p)++;
+        *v += (uint32_t) (b & 0x7f) << m;
+        m += 7;
+    } while (b & 0x80);
+
+    return 0;
+}
+
+static int huffman_decode(bytes *out, const uint8_t *p, size_t len) {
+    int16_t node = 0;
+    int depth = 0;
+
+    out->len = 0;
+    bytes_reserve(out, len * 8 / 5 + 1);
+
+    for (size_t i = 0; i < len; i++) {
+        for (int j = 7; j >= 0; j--) {
+            node = huffman_tree[node][(p[i] >> j) & 1];
+            depth++;
+            if (node < 0) {
+                int sym = -1 - node;
+                if (sym == 256) return -1;
+                out->data[out->len++] = sym;
+                node  = 0;
+                depth = 0;
+            } else if (node == 0) {
+                return -1;
+            }
+        }
+    }
+
+    // padding must be a prefix of EOS, i.e. fewer than 8 one bits
+    return depth > 7 ? -1 : 0;
+}
+
+static int hpack_string(const uint8_t **p, const uint8_t *end, bytes *scratch, char **s, size_t *len) {
+    bool huff = *p < end && (**p & 0x80);
+    uint32_t n;
+
+    if (hpack_int(p, end, 7, &n) || n > (size_t) (end - *p)) return -1;
+
+    if (huff) {
+        if (huffman_decode(scratch, *p, n)) return -1;
+        *s   = scratch->data;
+        *len = scratch->len;
+    } else {
+        *s   = (char *) *p;
+        *len = n;
+    }
+
+    *p += n;
+    return 0;
+}
+
+static entry *table_get(http2 *s, uint32_t index, entry *e) {
+    if (index == 0) return NULL;
+    if (index <= STATIC_ENTRIES) {
+        e->name      = static_table[index - 1].name;
+        e->name_len  = strlen(e->name);
+        e->value     = static_table[index - 1].value;
+        e->value_len = strlen(e->value);
+        return e;
+    }
+    index -= STATIC_ENTRIES + 1;
+    if (index >= s->table.count) return NULL;
+    return &s->table.entries[(s->table.first + index) % TABLE_ENTRIES];
+}
+
+static void table_evict(http2 *s, size_t max) {
+    while (s->table.count && s->table.size > max) {
+        size_t last = (s->table.first + s->table.count - 1) % TABLE_ENTRIES;
+        entry *e = &s->table.entries[last];
+        s->table.size -= e->name_len + e->value_len + 32;
+        zfree(e->name);
+        s->table.count--;
+    }
+}
+
+static void table_add(http2 *s, const char *name, size_t name_len, const char *value, size_t value_len) {
+    size_t size = name_len + value_len + 32;
+
+    table_evict(s, size > s->table.max ? 0 : s->table.max - size);
+    if (size > s->table.max || s->table.count == TABLE_ENTRIES) return;
+
+    s->table.first = (s->table.first + TABLE_ENTRIES - 1) % TABLE_ENTRIES;
+    entry *e = &s->table.entries[s->table.first];
+    e->name      = zmalloc(name_len + value_len + 1);
+    e->name_len  = name_len;
+    e->value     = e->name + name_len;
+    e->value_len = value_len;
+    memcpy(e->name,  name,  name_len);
+    memcpy(e->value, value, value_len);
+    s->table.count++;
+    s->table.size += size;
+}
+
+// A 1xx block such as 100 Continue or 103 Early Hints precedes the final
+// response on the same stream, neither its status nor headers are passed on.
+static int emit_header(http2 *s, uint32_t id, const char *name, size_t name_len, const char *value, size_t value_len) {
+    const http2_settings *settings = s->settings;
+
+    if (name_len == 7 && !memcmp(name, ":status", 7)) {
+        int status = 0;
+        for (size_t i = 0; i < value_len && i < 3; i++) status = status * 10 + value[i] - '0';
+        if ((s->interim = status < 200)) return 0;
+        return settings->on_status ? settings->on_status(s, id, status) : 0;
+    }
+
+    if (s->interim || (name_len > 0 && name[0] == ':')) return 0;
+    return settings->on_header ? settings->on_header(s, id, name, name_len, value, value_len) : 0;
+}
+
+static int hpack_decode(http2 *s, uint32_t id, const uint8_t *p, size_t len) {
+    const uint8_t *end = p + len;
+
+    while (p < end) {
+        uint8_t b = *p;
+        uint32_t index;
+        char *name, *value;
+        size_t name_len, value_len;
+        entry *e, tmp;
+
+        if (b & 0x80) {
+            if (hpack_int(&p, end, 7, &index) || !(e = table_get(s, index, &tmp))) return -1;
+            if (emit_header(s, id, e->name, e->name_len, e->value, e->value_len)) return -1;
+            continue;
+        }
+
+        if ((b & 0xe0) == 0x20) {
+            if (hpack_int(&p, end, 5, &index) || index > HTTP2_TABLE_SIZE) return -1;
+            s->table.max = index;
+            table_evict(s, index);
+            continue;
+        }
+
+        bool indexing = b & 0x40;
+        if (hpack_int(&p, end, indexing ? 6 : 4, &index)) return -1;
+
+        if (index) {
+            if (!(e = table_get(s, index, &tmp))) return -1;
+            name     = e->name;
+            name_len = e->name_len;
+        } else if (hpack_string(&p, end, &s->name, &name, &name_len)) {
+            return -1;
+        }
+
+        if (hpack_string(&p, end, &s->value, &value, &value_len)) return -1;
+
+        if (indexing) {
+            // the name may point into an entry that adding this one evicts
+            if (index) {
+                s->name.len = 0;
+                bytes_append(&s->name, name, name_len);
+                name = s->name.data;
+            }
+            table_add(s, name, name_len, value, value_len);
+        }
+
+        if (emit_header(s, id, name, name_len, value, value_len)) return -1;
+    }
+
+    return 0;
+}
+
+// Framing
+
+static void frame_header(http2 *s, uint32_t len, uint8_t type, uint8_t flags, uint32_t id) {
+    uint8_t h[9] = { len >> 16, len >> 8, len, type, flags };
+    put32(&h[5], id);
+    bytes_append(&s->out, h, sizeof(h));
+}
+
+static void send_window_update(http2 *s, uint32_t id, uint32_t increment) {
+    uint8_t p[4];
+    put32(p, increment);
+    frame_header(s, 4, FRAME_WINDOW_UPDATE, 0, id);
+    bytes_append(&s->out, p, 4);
+}
+
+static stream *find_stream(http2 *s, uint32_t id) {
+    for (size_t i = 0; i < s->limit; i++) {
+        if (s->streams[i].id == id) return &s->streams[i];
+    }
+    return NULL;
+}
+
+static int close_stream(http2 *s, stream *st, uint32_t error) {
+    uint32_t id = st->id;
+    zfree(st->body);
+    *st = (stream) { 0 };
+    s->active--;
+    return s->settings->on_close ? s->settings->on_close(s, id, error) : 0;
+}
+
+// Send as much queued request body as the flow control windows allow.
+static void flush_data(http2 *s) {
+    for (size_t i = 0; i < s->limit && s->window > 0; i++) {
+        stream *st = &s->streams[i];
+
+        while (st->id && st->sending && (st->window > 0 || st->sent == st->body_len)) {
+            size_t len = st->body_len - st->sent;
+            len = MIN(len, (size_t) MIN(s->window, st->window));
+            len = MIN(len, s->peer_frame);
+
+            uint8_t flags = st->sent + len == st->body_len ? FLAG_END_STREAM : 0;
+            frame_header(s, len, FRAME_DATA, flags, st->id);
+            bytes_append(&s->out, st->body + st->sent, len);
+
+            st->sent   += len;
+            st->window -= len;
+            s->window  -= len;
+
+            if (flags) {
+                st->sending = false;
+                zfree(st->body);
+                st->body = NULL;
+            }
+            if (s->window <= 0) break;
+        }
+    }
+}
+
+static int on_settings(http2 *s, uint8_t flags, const uint8_t *p, size_t len) {
+    if (flags & FLAG_ACK) return 0;
+    if (len % 6) return -1;
+
+    for (; len > 0; p += 6, len -= 6) {
+        uint16_t id = p[0] << 8 | p[1];
+        uint32_t value = get32(&p[2]);
+
+        switch (id) {
+            case SETTINGS_MAX_CONCURRENT_STREAMS:
+                s->peer_streams = value;
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > MAX_STREAM_ID) return -1;
+                for (size_t i = 0; i < s->limit; i++) {
+                    if (s->streams[i].id) s->streams[i].window += (int64_t) value - s->peer_window;
+                }
+                s->peer_window = value;
+                break;
+            case SETTINGS_MAX_FRAME_SIZE:
+                if (value < HTTP2_MAX_FRAME || value > 0xffffff) return -1;
+                s->peer_frame = value;
+                break;
+        }
+    }
+
+    frame_header(s, 0, FRAME_SETTINGS, FLAG_ACK, 0);
+    flush_data(s);
+    return 0;
+}
+
+static int end_headers(http2 *s) {
+    stream *st = find_stream(s, s->block_stream);
+
+    s->in_block = false;
+    s->interim  = false;
+    if (hpack_decode(s, st ? st->id : 0, (uint8_t *) s->block.data, s->block.len)) return -1;
+    if (st && (s->block_flags & FLAG_END_STREAM)) return close_stream(s, st, HTTP2_NO_ERROR);
+
+    return 0;
+}
+
+// Strip padding and return the payload, or NULL if the padding is invalid.
+static const uint8_t *unpad(uint8_t flags, const uint8_t *p, uint32_t *len) {
+    if (!(flags & FLAG_PADDED)) return p;
+    if (*len < 1 || p[0] >= *len) return NULL;
+    *len -= p[0] + 1;
+    return p + 1;
+}
+
+static int frame(http2 *s, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *p, uint32_t len) {
+    uint32_t total = len;
+    stream *st;
+
+    if (s->in_block && (type != FRAME_CONTINUATION || id != s->block_stream)) return -1;
+
+    switch (type) {
+        case FRAME_DATA:
+            if (!id || !(p = unpad(flags, p, &len))) return -1;
+
+            s->consumed += total;
+            if (s->consumed >= HTTP2_CONN_WINDOW / 2) {
+                send_window_update(s, 0, s->consumed);
+                s->consumed = 0;
+            }
+
+            if (!(st = find_stream(s, id))) return 0;
+            if (len && s->settings->on_data && s->settings->on_data(s, id, (char *) p, len)) return -1;
+            if (flags & FLAG_END_STREAM) return close_stream(s, st, HTTP2_NO_ERROR);
+
+            st->consumed += total;
+            if (st->consumed >= HTTP2_WINDOW / 2) {
+                send_window_update(s, id, st->consumed);
+                st->consumed = 0;
+            }
+            return 0;
+
+        case FRAME_HEADERS:
+            if (!id || !(p = unpad(flags, p, &len))) return -1;
+            if (flags & FLAG_PRIORITY) {
+                if (len < 5) return -1;
+                p   += 5;
+                len -= 5;
+            }
+            s->block.len    = 0;
+            s->block_stream = id;
+            s->block_flags  = flags;
+            s->in_block     = true;
+            bytes_append(&s->block, p, len);
+            return (flags & FLAG_END_HEADERS) ? end_headers(s) : 0;
+
+        case FRAME_CONTINUATION:
+            if (!s->in_block) return -1;
+            bytes_append(&s->block, p, len);
+            return (flags & FLAG_END_HEADERS) ? end_headers(s) : 0;
+
+        case FRAME_RST_STREAM:
+            if (!id || len != 4) return -1;
+            if (!(st = find_stream(s, id))) return 0;
+            return close_stream(s, st, get32(p));
+
+        case FRAME_SETTINGS:
+            if (id) return -1;
+            return on_settings(s, flags, p, len);
+
+        case FRAME_PING:
+            if (id || len != 8) return -1;
+            if (!(flags & FLAG_ACK)) {
+                frame_header(s, 8, FRAME_PING, FLAG_ACK, 0);
+                bytes_append(&s->out, p, 8);
+            }
+            return 0;
+
+        case FRAME_GOAWAY:
+            if (id || len < 8) return -1;
+            s->goaway = true;
+            uint32_t last = get32(p) & MAX_STREAM_ID;
+            for (size_t i = 0; i < s->limit; i++) {
+                st = &s->streams[i];
+                if (st->id > last && close_stream(s, st, HTTP2_REFUSED_STREAM)) return -1;
+            }
+            return 0;
+
+        case FRAME_WINDOW_UPDATE:
+            if (len != 4) return -1;
+            uint32_t increment = get32(p) & MAX_STREAM_ID;
+            if (!id) {
+                s->window += increment;
+            } else if ((st = find_stream(s, id))) {
+                st->window += increment;
+            }
+            flush_data(s);
+            return 0;
+
+        case FRAME_PUSH_PROMISE:
+            // disabled in our SETTINGS
+            return -1;
+
+        default:
+            return 0;
+    }
+}
+
+// Session
+
+http2 *http2_new(const http2_settings *settings, size_t limit, void *data) {
+    pthread_once(&huffman_once, huffman_build);
+
+    http2 *s = zcalloc(sizeof(http2));
+    s->data     = data;
+    s->settings = settings;
+    s->limit    = limit;
+    s->streams  = zcalloc(limit * sizeof(stream));
+    http2_reset(s);
+    return s;
+}
+
+// Prepare for a new connection, dropping all streams and queueing the
+// connection preface.
+void http2_reset(http2 *s) {
+    for (size_t i = 0; i < s->limit; i++) zfree(s->streams[i].body);
+    memset(s->streams, 0, s->limit * sizeof(stream));
+    table_evict(s, 0);
+
+    s->active       = 0;
+    s->next_id      = 1;
+    s->peer_streams = UINT32_MAX;
+    s->peer_window  = DEFAULT_WINDOW;
+    s->peer_frame   = HTTP2_MAX_FRAME;
+    s->window       = DEFAULT_WINDOW;
+    s->consumed     = 0;
+    s->goaway       = false;
+    s->in.len       = 0;
+    s->out.len      = 0;
+    s->out_sent     = 0;
+    s->in_block     = false;
+    s->table.first  = 0;
+    s->table.max    = HTTP2_TABLE_SIZE;
+
+    uint8_t settings[12] = { 0, SETTINGS_ENABLE_PUSH, 0, 0, 0, 0, 0, SETTINGS_INITIAL_WINDOW_SIZE };
+    put32(&settings[8], HTTP2_WINDOW);
+
+    bytes_append(&s->out, preface, sizeof(preface) - 1);
+    frame_header(s, sizeof(settings), FRAME_SETTINGS, 0, 0);
+    bytes_append(&s->out, settings, sizeof(settings));
+    send_window_update(s, 0, HTTP2_CONN_WINDOW - DEFAULT_WINDOW);
+}
+
+void http2_free(http2 *s) {
+    for (size_t i = 0; i < s->limit; i++) zfree(s->streams[i].body);
+    table_evict(s, 0);
+    bytes_free(&s->in);
+    bytes_free(&s->out);
+    bytes_free(&s->block);
+    bytes_free(&s->name);
+    bytes_free(&s->value);
+    zfree(s->streams);
+    zfree(s);
+}
+
+// Bytes allocated for the session, the dynamic table counted at its HPACK
+// size.
+size_t http2_memory(http2 *s) {
+    return sizeof(http2) + s->limit * sizeof(stream) + s->in.cap + s->out.cap +
+           s->block.cap + s->name.cap + s->value.cap + s->table.size;
+}
+
+void *http2_data(http2 *s) {
+    return s->data;
+}
+
+static ssize_t process(http2 *s, const uint8_t *p, size_t len) {
+    size_t off = 0;
+
+    while (len - off >= 9) {
+        const uint8_t *h = p + off;
+        uint32_t flen = h[0] << 16 | h[1] << 8 | h[2];
+
+        if (flen > HTTP2_MAX_FRAME) return -1;
+        if (len - off < 9 + flen) break;
+
+        if (frame(s, h[3], h[4], get32(&h[5]) & MAX_STREAM_ID, h + 9, flen)) return -1;
+        off += 9 + flen;
+    }
+
+    return off;
+}
+
+// Parse received bytes, invoking callbacks for each response event. Any
+// incomplete frame is kept for the next call.
+int http2_execute(http2 *s, const char *data, size_t len) {
+    ssize_t n;
+
+    if (s->in.len) {
+        bytes_append(&s->in, data, len);
+        if ((n = process(s, (uint8_t *) s->in.data, s->in.len)) < 0) return -1;
+        memmove(s->in.data, s->in.data + n, s->in.len - n);
+        s->in.len -= n;
+        return 0;
+    }
+
+    if ((n = process(s, (uint8_t *) data, len)) < 0) return -1;
+    bytes_append(&s->in, data + n, len - n);
+    return 0;
+}
+
+bool http2_can_submit(http2 *s) {
+    return !http2_exhausted(s) && s->active < s->limit && s->active < s->peer_streams;
+}
+
+bool http2_exhausted(http2 *s) {
+    return s->goaway || s->next_id > MAX_STREAM_ID;
+}
+
+size_t http2_active(http2 *s) {
+    return s->active;
+}
+
+// Open a new stream for the request, returning its id or 0 if no more
+// streams may be opened right now.
+uint32_t http2_submit(http2 *s, http2_request *r) {
+    stream *st = find_stream(s, 0);
+
+    if (!http2_can_submit(s) || !st) return 0;
+
+    st->id      = s->next_id;
+    st->window  = s->peer_window;
+    st->sending = r->body_len > 0;
+    if (st->sending) {
+        st->body     = zmalloc(r->body_len);
+        st->body_len = r->body_len;
+        memcpy(st->body, r->body, r->body_len);
+    }
+    s->next_id += 2;
+    s->active++;
+
+    size_t off = 0;
+    uint8_t type = FRAME_HEADERS;
+    do {
+        size_t len = MIN(r->block_len - off, s->peer_frame);
+        uint8_t flags = 0;
+        if (off + len == r->block_len) flags |= FLAG_END_HEADERS;
+        if (type == FRAME_HEADERS && !st->sending) flags |= FLAG_END_STREAM;
+        frame_header(s, len, type, flags, st->id);
+        bytes_append(&s->out, r->block + off, len);
+        off += len;
+        type = FRAME_CONTINUATION;
+    } while (off < r->block_len);
+
+    flush_data(s);
+    return st->id;
+}
+
+struct iovec http2_output(http2 *s) {
+    return (struct iovec) { s->out.data + s->out_sent, s->out.len - s->out_sent };
+}
+
+void http2_consume(http2 *s, size_t n) {
+    s->out_sent += n;
+    if (s->out_sent == s->out.len) {
+        s->out.len  = 0;
+        s->out_sent = 0;
+    } else if (s->out_sent > s->out.cap / 2) {
+        memmove(s->out.data, s->out.data + s->out_sent, s->out.len - s->out_sent);
+        s->out.len -= s->out_sent;
+        s->out_sent = 0;
+    }
+}
+
+// Request conversion
+
+typedef struct {
+    const char *scheme;
+    bytes url;
+    bytes headers;
+    bytes body;
+    bool value;
+    http2_request *requests;
+    size_t count;
+} convert;
+
+static int convert_url(http_parser *parser, const char *at, size_t len) {
+    convert *c = parser->data;
+    bytes_append(&c->url, at, len);
+    return 0;
+}
+
+static int convert_field(http_parser *parser, const char *at, size_t len) {
+    convert *c = parser->data;
+    if (c->value) {
+        bytes_byte(&c->headers, '\0');
+        c->value = false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        bytes_byte(&c->headers, at[i] >= 'A' && at[i] <= 'Z' ? at[i] + 32 : at[i]);
+    }
+    return 0;
+}
+
+static int convert_value(http_parser *parser, const char *at, size_t len) {
+    convert *c = parser->data;
+    if (!c->value) {
+        bytes_byte(&c->headers, '\0');
+        c->value = true;
+    }
+    bytes_append(&c->headers, at, len);
+    return 0;
+}
+
+static int convert_body(http_parser *parser, const char *at, size_t len) {
+    convert *c = parser->data;
+    bytes_append(&c->body, at, len);
+    return 0;
+}
+
+static bool connection_specific(const char *name) {
+    static const char *names[] = {
+        "connection", "keep-alive", "proxy-connection", "transfer-encoding",
+        "upgrade", "host", NULL
+    };
+    for (const char **n = names; *n; n++) {
+        if (!strcmp(name, *n)) return true;
+    }
+    return false;
+}
+
+static int convert_complete(http_parser *parser) {
+    convert *c = parser->data;
+    const char *method = http_method_str(parser->method);
+    const char *authority = "";
+    bytes block = { 0 };
+
+    if (c->value) bytes_byte(&c->headers, '\0');
+    char *end = c->headers.data + c->headers.len;
+
+    for (char *h = c->headers.data; h && h < end; h += strlen(h) + 1) {
+        char *v = h + strlen(h) + 1;
+        if (!strcmp(h, "host")) authority = v;
+        h = v;
+    }
+
+    hpack_put_header(&block, ":method", 7, method, strlen(method));
+    hpack_put_header(&block, ":scheme", 7, c->scheme, strlen(c->scheme));
+    hpack_put_header(&block, ":authority", 10, authority, strlen(authority));
+    hpack_put_header(&block, ":path", 5, c->url.data, c->url.len);
+
+    for (char *h = c->headers.data; h && h < end; h += strlen(h) + 1) {
+        char *v = h + strlen(h) + 1;
+        if (!connection_specific(h) && (strcmp(h, "te") || !strcasecmp(v, "trailers"))) {
+            hpack_put_header(&block, h, strlen(h), v, strlen(v));
+        }
+        h = v;
+    }
+
+    c->requests = zrealloc(c->requests, (c->count + 1) * sizeof(http2_request));
+    c->requests[c->count++] = (http2_request) {
+        .block     = block.data,
+        .block_len = block.len,
+        .body      = c->body.len ? c->body.data : NULL,
+        .body_len  = c->body.len,
+    };
+    if (!c->body.len) bytes_free(&c->body);
+
+    c->url.len     = 0;
+    c->headers.len = 0;
+    c->body        = (bytes) { 0 };
+    c->value       = false;
+    return 0;
+}
+
+// Convert one or more HTTP/1.1 requests, as produced by request(), into
+// HTTP/2 header blocks and bodies. Returns NULL if no complete request
+// could be parsed.
+http2_request *http2_convert(struct iovec *iov, int iovcnt, const char *scheme, size_t *count) {
+    static const http_parser_settings settings = {
+        .on_url              = convert_url,
+        .on_header_field     = convert_field,
+        .on_header_value     = convert_value,
+        .on_body             = convert_body,
+        .on_message_complete = convert_complete,
+    };
+    convert c = { .scheme = scheme };
+    http_parser parser;
+
+    http_parser_init(&parser, HTTP_REQUEST);
+    parser.data = &c;
+
+    for (int i = 0; i < iovcnt; i++) {
+        size_t n = http_parser_execute(&parser, &settings, iov[i].iov_base, iov[i].iov_len);
+        if (n != iov[i].iov_len) break;
+    }
+
+    bytes_free(&c.url);
+    bytes_free(&c.headers);
+    bytes_free(&c.body);
+
+    *count = c.count;
+    return c.requests;
+}
+
+void http2_requests_free(http2_request *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        zfree(requests[i].block);
+        zfree(requests[i].body);
+    }
+    zfree(requests);
+}
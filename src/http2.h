@@ -0,0 +1,55 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define HTTP2_MAX_FRAME     16384
+#define HTTP2_TABLE_SIZE    4096
+#define HTTP2_WINDOW        (1 << 24)
+#define HTTP2_CONN_WINDOW   (1 << 30)
+
+#define HTTP2_NO_ERROR        0x0
+#define HTTP2_PROTOCOL_ERROR  0x1
+#define HTTP2_REFUSED_STREAM  0x7
+
+typedef struct http2 http2;
+
+// A request converted from HTTP/1.1 text. The header block is encoded
+// without touching the HPACK dynamic table, so it can be sent on any
+// connection any number of times.
+typedef struct {
+    char  *block;
+    size_t block_len;
+    char  *body;
+    size_t body_len;
+} http2_request;
+
+typedef struct {
+    int (*on_status)(http2 *, uint32_t, int);
+    int (*on_header)(http2 *, uint32_t, const char *, size_t, const char *, size_t);
+    int (*on_data)(http2 *, uint32_t, const char *, size_t);
+    int (*on_close)(http2 *, uint32_t, uint32_t);
+} http2_settings;
+
+http2 *http2_new(const http2_settings *, size_t, void *);
+void http2_reset(http2 *);
+void http2_free(http2 *);
+size_t http2_memory(http2 *);
+void *http2_data(http2 *);
+
+int http2_execute(http2 *, const char *, size_t);
+uint32_t http2_submit(http2 *, http2_request *);
+bool http2_can_submit(http2 *);
+bool http2_exhausted(http2 *);
+size_t http2_active(http2 *);
+
+struct iovec http2_output(http2 *);
+void http2_consume(http2 *, size_t);
+
+http2_request *http2_convert(struct iovec *, int, const char *, size_t *);
+void http2_requests_free(http2_request *, size_t);
+
+#endif /* HTTP2_H */
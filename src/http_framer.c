@@ -0,0 +1,273 @@
+// Response framing for when only message boundaries matter.
+//
+// Finds where each response ends and nothing else: the status code,
+// Content-Length, chunk sizes and whether the connection stays open. The
+// end of the headers is found with SSE2 or AVX2 where available. Headers
+// are only handled when they arrive whole in one buffer, and anything
+// unusual, like a 1xx status or a body delimited by close, is handed back
+// to the caller to run through http_parser.
+
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "http_framer.h"
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+
+static const char *(*find_header_end)(const char *, const char *);
+static pthread_once_t find_once = PTHREAD_ONCE_INIT;
+
+static const char *find_scalar(const char *p, const char *end) {
+    for (; end - p >= 4; p++) {
+        if (!(p = memchr(p, '\r', end - p - 3))) return NULL;
+        if (p[1] == '\n' && p[2] == '\r' && p[3] == '\n') return p;
+    }
+    return NULL;
+}
+
+// Compare 16 or 32 positions at a time against each byte of \r\n\r\n using
+// overlapping unaligned loads, so a match split across blocks is not missed.
+
+#ifdef __SSE2__
+static const char *find_sse2(const char *p, const char *end) {
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+
+    for (; end - p >= 19; p += 16) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 0)), cr);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 1)), lf);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 2)), cr);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 3)), lf);
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+
+    return find_scalar(p, end);
+}
+#endif
+
+#if defined(__SSE2__) && defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_AVX2_DISPATCH
+
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *p, const char *end) {
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+
+    for (; end - p >= 35; p += 32) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 0)), cr);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 1)), lf);
+        __m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 2)), cr);
+        __m256i d = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 3)), lf);
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, d)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+
+    return find_sse2(p, end);
+}
+#endif
+
+static void find_select() {
+    find_header_end = find_scalar;
+#ifdef __SSE2__
+    find_header_end = find_sse2;
+#endif
+#ifdef HAVE_AVX2_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) find_header_end = find_avx2;
+#endif
+}
+
+void http_framer_init(http_framer *f) {
+    pthread_once(&find_once, find_select);
+    *f = (http_framer) { .state = FRAMER_HEADER };
+}
+
+static bool value_is(const char *value, size_t len, const char *s) {
+    return len == strlen(s) && !strncasecmp(value, s, len);
+}
+
+// Parse a header block ending just past its blank line. Returns
+// FRAMER_COMPLETE for a response without a body, FRAMER_MORE when a body
+// follows and FRAMER_FALLBACK for anything that needs http_parser.
+static framer_result parse_header(http_framer *f, const char *p, const char *end) {
+    bool length = false, chunked = false;
+    uint64_t content_length = 0;
+
+    if (end - p < 17 || memcmp(p, "HTTP/1.", 7)) return FRAMER_FALLBACK;
+    if ((p[7] != '0' && p[7] != '1') || p[8] != ' ' || (p[12] != ' ' && p[12] != '\r')) return FRAMER_FALLBACK;
+
+    f->status = 0;
+    for (int i = 9; i < 12; i++) {
+        if (p[i] < '0' || p[i] > '9') return FRAMER_FALLBACK;
+        f->status = f->status * 10 + p[i] - '0';
+    }
+    if (f->status < 200) return FRAMER_FALLBACK;
+    f->keep_alive = p[7] == '1';
+
+    const char *line = (const char *) memchr(p, '\n', end - p) + 1;
+
+    while (line < end - 2) {
+        const char *eol = memchr(line, '\n', end - line);
+        const char *colon = memchr(line, ':', eol - line);
+
+        if (eol[-1] != '\r' || !colon || line[0] == ' ' || line[0] == '\t') return FRAMER_FALLBACK;
+
+        const char *value = colon + 1, *last = eol - 1;
+        while (value < last && (*value == ' ' || *value == '\t')) value++;
+        while (last > value && (last[-1] == ' ' || last[-1] == '\t')) last--;
+
+        size_t name_len = colon - line, value_len = last - value;
+
+        if (name_len == 14 && !strncasecmp(line, "content-length", 14)) {
+            if (length || value_len == 0) return FRAMER_FALLBACK;
+            for (const char *v = value; v < last; v++) {
+                if (*v < '0' || *v > '9' || content_length > (UINT64_MAX - 9) / 10) return FRAMER_FALLBACK;
+                content_length = content_length * 10 + *v - '0';
+            }
+            length = true;
+        } else if (name_len == 17 && !strncasecmp(line, "transfer-encoding", 17)) {
+            if (chunked || !value_is(value, value_len, "chunked")) return FRAMER_FALLBACK;
+            chunked = true;
+        } else if (name_len == 10 && !strncasecmp(line, "connection", 10)) {
+            if (value_is(value, value_len, "close")) {
+                f->keep_alive = false;
+            } else if (value_is(value, value_len, "keep-alive")) {
+                f->keep_alive = true;
+            } else {
+                return FRAMER_FALLBACK;
+            }
+        } else if (name_len == 7 && !strncasecmp(line, "upgrade", 7)) {
+            return FRAMER_FALLBACK;
+        }
+
+        line = eol + 1;
+    }
+
+    if (f->status == 204 || f->status == 304) return FRAMER_COMPLETE;
+    if (chunked == length) return FRAMER_FALLBACK;
+
+    if (chunked) {
+        f->state     = FRAMER_CHUNK_SIZE;
+        f->remaining = 0;
+        return FRAMER_MORE;
+    }
+
+    if (content_length == 0) return FRAMER_COMPLETE;
+    f->state     = FRAMER_BODY;
+    f->remaining = content_length;
+    return FRAMER_MORE;
+}
+
+static int hex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Consume bytes until the end of the current response. On return *result
+// says whether more data is needed, a response ended at the returned
+// offset, or the response starting at the returned offset must be given to
+// http_parser instead.
+size_t http_framer_execute(http_framer *f, const char *data, size_t len, framer_result *result) {
+    const char *p = data, *end = data + len, *h;
+    size_t n;
+    int v;
+
+    while (p < end) {
+        switch (f->state) {
+            case FRAMER_HEADER:
+                if (!(h = find_header_end(p, end))) goto fallback;
+                h += 4;
+                switch (parse_header(f, p, h)) {
+                    case FRAMER_MORE:     p = h; break;
+                    case FRAMER_COMPLETE: p = h; goto complete;
+                    default:              goto fallback;
+                }
+                break;
+
+            case FRAMER_BODY:
+                n = MIN(f->remaining, (uint64_t) (end - p));
+                p += n;
+                if ((f->remaining -= n) == 0) goto complete;
+                break;
+
+            case FRAMER_CHUNK_SIZE:
+                if ((v = hex(*p)) >= 0) {
+                    if (f->remaining > (UINT64_MAX >> 4)) goto error;
+                    f->remaining = f->remaining << 4 | v;
+                    p++;
+                    break;
+                }
+                f->state = FRAMER_CHUNK_EXT;
+                // fall through
+
+            case FRAMER_CHUNK_EXT:
+                if (!(h = memchr(p, '\n', end - p))) {
+                    p = end;
+                    break;
+                }
+                p = h + 1;
+                f->state = f->remaining ? FRAMER_CHUNK_DATA : FRAMER_TRAILER;
+                break;
+
+            case FRAMER_CHUNK_DATA:
+                n = MIN(f->remaining, (uint64_t) (end - p));
+                p += n;
+                if ((f->remaining -= n) == 0) f->state = FRAMER_CHUNK_END;
+                break;
+
+            case FRAMER_CHUNK_END:
+                if (!(h = memchr(p, '\n', end - p))) {
+                    p = end;
+                    break;
+                }
+                p = h + 1;
+                f->state = FRAMER_CHUNK_SIZE;
+                break;
+
+            case FRAMER_TRAILER:
+                if (*p == '\n') {
+                    p++;
+                    goto complete;
+                }
+                if (*p++ != '\r') f->state = FRAMER_TRAILER_LINE;
+                break;
+
+            case FRAMER_TRAILER_LINE:
+                if (!(h = memchr(p, '\n', end - p))) {
+                    p = end;
+                    break;
+                }
+                p = h + 1;
+                f->state = FRAMER_TRAILER;
+                break;
+        }
+    }
+
+    *result = FRAMER_MORE;
+    return len;
+
+  complete:
+    f->state = FRAMER_HEADER;
+    *result = FRAMER_COMPLETE;
+    return p - data;
+
+  fallback:
+    *result = FRAMER_FALLBACK;
+    return p - data;
+
+  error:
+    *result = FRAMER_ERROR;
+    return p - data;
+}
+
+// Body bytes that can be skipped without looking at them, callers that do
+// so must subtract the number skipped from f->remaining.
+uint64_t http_framer_remaining(const http_framer *f) {
+    return f->state == FRAMER_BODY || f->state == FRAMER_CHUNK_DATA ? f->remaining : 0;
+}
@@ -0,0 +1,35 @@
+#ifndef HTTP_FRAMER_H
+#define HTTP_FRAMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    FRAMER_MORE,
+    FRAMER_COMPLETE,
+    FRAMER_FALLBACK,
+    FRAMER_ERROR
+} framer_result;
+
+typedef struct {
+    enum {
+        FRAMER_HEADER,
+        FRAMER_BODY,
+        FRAMER_CHUNK_SIZE,
+        FRAMER_CHUNK_EXT,
+        FRAMER_CHUNK_DATA,
+        FRAMER_CHUNK_END,
+        FRAMER_TRAILER,
+        FRAMER_TRAILER_LINE
+    } state;
+    uint64_t remaining;
+    int status;
+    bool keep_alive;
+} http_framer;
+
+void http_framer_init(http_framer *);
+size_t http_framer_execute(http_framer *, const char *, size_t, framer_result *);
+uint64_t http_framer_remaining(const http_framer *);
+
+#endif /* HTTP_FRAMER_H */
@@ -2404,6 +2404,24 @@ http_body_is_final(const struct http_parser *parser) {
     return parser->state == s_message_done;
 }
 
+uint64_t
+http_body_remaining(const struct http_parser *parser) {
+    if (HTTP_PARSER_ERRNO(parser) != HPE_OK) return 0;
+    switch (parser->state) {
+        case s_body_identity:
+        case s_chunk_data:
+            return parser->content_length;
+        default:
+            return 0;
+    }
+}
+
+void
+http_body_skip(struct http_parser *parser, uint64_t n) {
+    assert(n < http_body_remaining(parser));
+    parser->content_length -= n;
+}
+
 unsigned long
 http_parser_version(void) {
   return HTTP_PARSER_VERSION_MAJOR * 0x10000 |
@@ -376,6 +376,15 @@ void http_parser_pause(http_parser *parser, int paused);
 /* Checks if this is the final chunk of the body. */
 int http_body_is_final(const http_parser *parser);
 
+/* Returns the number of body bytes the parser expects before the end of
+ * the current body or chunk, or 0 if it is not inside a sized body. */
+uint64_t http_body_remaining(const http_parser *parser);
+
+/* Accounts for n body bytes consumed without being parsed. n must be
+ * less than http_body_remaining() so the parser still sees the last
+ * byte and completes the body or chunk itself. */
+void http_body_skip(http_parser *parser, uint64_t n);
+
 #ifdef __cplusplus
 }
 #endif
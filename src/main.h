@@ -2,22 +2,26 @@
 #define MAIN_H
 
 #include <ctype.h>
+#include <limits.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <math.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <signal.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 
 #include "ssl.h"
 #include "aprintf.h"
@@ -25,30 +29,98 @@
 #include "units.h"
 #include "zmalloc.h"
 
+#ifdef __linux__
+#include <linux/net_tstamp.h>
+#endif
+
+#if defined(__linux__) && !defined(IP_BIND_ADDRESS_NO_PORT)
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
 struct config;
 
 static void *thread_main(void *);
 static int connect_socket(thread *, connection *);
 static int reconnect_socket(thread *, connection *);
+static int retry_connect(aeEventLoop *, long long, void *);
+static int bind_source(int, int);
+static void set_sockopts(int, int);
+static void update_targets(lua_State *);
+static void resolve_until(lua_State *, char *, char *, uint64_t);
+static uint64_t target_weight(target *);
+static target *least_loaded(target_set *);
+static target *pick_target(thread *, target_set *);
+static void target_record(target *, uint64_t);
+static bool target_moved(connection *);
+static void get_sockopts(int, int);
 
+static void repeat_request(request *, uint64_t);
+static void busy_poll(thread *);
+static void zerocopy_release(thread *, connection *, bool);
+static bool zerocopy_pending(connection *);
 static int record_rate(aeEventLoop *, long long, void *);
 
+static void handshake_complete(connection *);
+static void handshake_readable(aeEventLoop *, int, void *, int);
+static void handshake_sweep(thread *);
+static void describe_tls(SSL *, char *, size_t);
+
 static void socket_connected(aeEventLoop *, int, void *, int);
 static void socket_writeable(aeEventLoop *, int, void *, int);
 static void socket_readable(aeEventLoop *, int, void *, int);
 
+static void record_events(connection *, const char *, size_t);
 static int response_complete(http_parser *);
+static void message_complete(connection *, int, bool);
+static int parse_responses(connection *, char *, size_t);
+static int frame_responses(connection *, char *, size_t);
+static int frame_protocol(connection *, char *, size_t);
 static int header_field(http_parser *, const char *, size_t);
 static int header_value(http_parser *, const char *, size_t);
 static int response_body(http_parser *, const char *, size_t);
 
+static int stream_status(http2 *, uint32_t, int);
+static int stream_header(http2 *, uint32_t, const char *, size_t, const char *, size_t);
+static int stream_data(http2 *, uint32_t, const char *, size_t);
+static int stream_close(http2 *, uint32_t, uint32_t);
+static void submit_streams(connection *);
+static int flush_streams(connection *);
+static bool streams_drained(connection *);
+static void streams_writeable(aeEventLoop *, int, void *, int);
+static void streams_readable(aeEventLoop *, int, void *, int);
+
+static void ws_handshake(lua_State *);
+static int ws_upgraded(connection *, char *);
+static void ws_frame(connection *, uint8_t, const char *, size_t, const char *, size_t);
+static void ws_message(connection *, uint64_t);
+static void ws_schedule(connection *, uint64_t);
+static int ws_interval();
+static int ws_tick(aeEventLoop *, long long, void *);
+static bool ws_stamp(connection *, websocket_parser *, uint64_t *);
+static int ws_received(websocket_parser *);
+static int ws_receive(connection *, char *, size_t);
+static int ws_flush(connection *);
+static void ws_writeable(aeEventLoop *, int, void *, int);
+static void ws_readable(aeEventLoop *, int, void *, int);
+
 static uint64_t time_us();
 
 static int parse_args(struct config *, char **, struct http_parser_url *, char **, int, char **);
+static int parse_source_addrs(struct config *, char *);
+static bool is_unix_url(char *);
+static char *parse_unix_url(struct config *, char *);
 static char *copy_url_part(char *, struct http_parser_url *, enum http_parser_url_fields);
 
 static void print_stats_header();
 static void print_stats(char *, stats *, char *(*)(long double));
-static void print_stats_latency(stats *);
+static void print_stats_latency(char *, stats *);
+static void print_stats_connections(thread *);
+static size_t connection_memory(connection *);
+static void print_stats_jitter(stats *);
+static void record_timestamps(connection *, uint64_t);
+static void print_stats_targets(long double);
+static bool sockopts_set(sockopts *);
+static void print_sockopts(sockopts *);
+static void print_mismatches(errors *);
 
 #endif /* MAIN_H */
@@ -3,6 +3,11 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#endif
 
 #include "net.h"
 
@@ -11,29 +16,194 @@ status sock_connect(connection *c, char *host) {
 }
 
 status sock_close(connection *c) {
+    if (c->ring) aeRingDetach(c->thread->loop, c->fd);
+    c->ring = false;
     return OK;
 }
 
-status sock_read(connection *c, size_t *n) {
-    ssize_t r = read(c->fd, c->buf, sizeof(c->buf));
+// Sockets attached to an io_uring loop are read and written through it
+// until they are released, then EBADF says to use the socket directly.
+static bool ring_done(connection *c, ssize_t r, size_t *n, status *s) {
+    if (r == -1 && errno == EBADF) {
+        c->ring = false;
+        return false;
+    }
+    if (r == -1) {
+        switch (errno) {
+            case EAGAIN: *s = RETRY; break;
+            default:     *s = ERROR; break;
+        }
+        return true;
+    }
     *n = (size_t) r;
-    return r >= 0 ? OK : ERROR;
+    *s = OK;
+    return true;
+}
+
+#if defined(SO_TIMESTAMPING) && defined(__linux__)
+// Prefer the raw hardware timestamp in ts[2] when the NIC produced one,
+// otherwise use the software one in ts[0]. Hardware timestamps come from
+// the NIC's own clock rather than CLOCK_REALTIME, so the caller is told
+// which one it got.
+static uint64_t cmsg_timestamp(struct cmsghdr *cm, bool *hardware) {
+    struct scm_timestamping *ts = (struct scm_timestamping *) CMSG_DATA(cm);
+    struct timespec *t = &ts->ts[2];
+    *hardware = t->tv_sec || t->tv_nsec;
+    if (!*hardware) t = &ts->ts[0];
+    return t->tv_sec * 1000000 + t->tv_nsec / 1000;
+}
+
+static bool is_timestamp(struct cmsghdr *cm) {
+    return cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING;
 }
+#endif
 
-status sock_write(connection *c, char *buf, size_t len, size_t *n) {
+status sock_read(connection *c, char **buf, size_t *n) {
     ssize_t r;
-    if ((r = write(c->fd, buf, len)) == -1) {
+    status s;
+
+    if (c->ring && ring_done(c, aeRingRead(c->thread->loop, c->fd, buf, c->thread->bufsize), n, &s)) {
+        return s;
+    }
+    *buf = c->thread->buf;
+
+#if defined(SO_TIMESTAMPING) && defined(__linux__)
+    if (c->timestamp && c->timestamp->enabled) {
+        char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+        struct iovec iov = { c->thread->buf, c->thread->bufsize };
+        struct msghdr msg = {
+            .msg_iov        = &iov,
+            .msg_iovlen     = 1,
+            .msg_control    = control,
+            .msg_controllen = sizeof(control),
+        };
+        if ((r = recvmsg(c->fd, &msg, 0)) > 0) {
+            for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                if (is_timestamp(cm)) c->timestamp->rx = cmsg_timestamp(cm, &c->timestamp->rx_hardware);
+            }
+        }
+    } else
+#endif
+    r = read(c->fd, c->thread->buf, c->thread->bufsize);
+
+    if (r == -1) {
         switch (errno) {
             case EAGAIN: return RETRY;
             default:     return ERROR;
         }
     }
+
     *n = (size_t) r;
     return OK;
 }
 
+// Drop up to len bytes of response body. Linux TCP sockets discard them in
+// the kernel with MSG_TRUNC, anything else reads into the thread buffer.
+// Large bodies are cheaper to truncate than to receive into the io_uring
+// buffers, so such sockets leave the ring.
+status sock_discard(connection *c, size_t len, size_t *n) {
+    ssize_t r;
+    status s;
+    char *buf;
+
+    if (c->ring && len >= RING_DISCARD_MIN && c->addr->ai_family != AF_UNIX) {
+        aeRingRelease(c->thread->loop, c->fd);
+    }
+    if (c->ring && ring_done(c, aeRingRead(c->thread->loop, c->fd, &buf, len), n, &s)) {
+        return s;
+    }
+
+#if defined(__linux__) && defined(MSG_TRUNC)
+    if (c->addr->ai_family != AF_UNIX) {
+        r = recv(c->fd, NULL, len, MSG_TRUNC | MSG_DONTWAIT);
+    } else
+#endif
+    r = read(c->fd, c->thread->buf, MIN(len, c->thread->bufsize));
+
+    if (r == -1) {
+        switch (errno) {
+            case EAGAIN: return RETRY;
+            default:     return ERROR;
+        }
+    }
+
+    *n = (size_t) r;
+    return OK;
+}
+
+status sock_write(connection *c, struct iovec *iov, int iovcnt, size_t *n) {
+    struct msghdr msg = {
+        .msg_iov    = iov,
+        .msg_iovlen = iovcnt,
+    };
+    int flags = 0;
+    ssize_t r;
+    status s;
+
+    if (c->ring && ring_done(c, aeRingWrite(c->thread->loop, c->fd, iov, iovcnt), n, &s)) {
+        return s;
+    }
+
+#ifdef MSG_ZEROCOPY
+    if (c->zerocopy && c->zerocopy->enabled) {
+        size_t len = 0;
+        for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+        if (len >= ZEROCOPY_MIN) flags |= MSG_ZEROCOPY;
+    }
+#endif
+
+    if ((r = sendmsg(c->fd, &msg, flags)) == -1 && flags && errno == ENOBUFS) {
+        r = sendmsg(c->fd, &msg, flags = 0);
+    }
+
+    if (r == -1) {
+        switch (errno) {
+            case EAGAIN: return RETRY;
+            default:     return ERROR;
+        }
+    }
+
+    if (flags) c->zerocopy->sent++;
+    *n = (size_t) r;
+    return OK;
+}
+
+// Drain the socket error queue, which carries both MSG_ZEROCOPY
+// completions and SO_TIMESTAMPING transmit timestamps.
+void sock_errqueue(connection *c) {
+#if defined(MSG_ZEROCOPY) && defined(__linux__)
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 128];
+    struct msghdr msg = {
+        .msg_control    = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    while (recvmsg(c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) != -1) {
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+#ifdef SO_TIMESTAMPING
+            if (is_timestamp(cm)) {
+                bool hardware;
+                uint64_t tx = cmsg_timestamp(cm, &hardware);
+                if (c->timestamp && (hardware || tx >= c->start)) {
+                    c->timestamp->tx = tx;
+                    c->timestamp->tx_hardware = hardware;
+                }
+                continue;
+            }
+#endif
+            struct sock_extended_err *err = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (c->zerocopy && err->ee_errno == 0 && err->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                c->zerocopy->done = err->ee_data + 1;
+            }
+        }
+        msg.msg_controllen = sizeof(control);
+    }
+#endif
+}
+
 size_t sock_readable(connection *c) {
     int n, rc;
+    if (c->ring) return aeRingPending(c->thread->loop, c->fd);
     rc = ioctl(c->fd, FIONREAD, &n);
     return rc == -1 ? 0 : n;
 }
@@ -15,8 +15,9 @@ typedef enum {
 struct sock {
     status ( *connect)(connection *, char *);
     status (   *close)(connection *);
-    status (    *read)(connection *, size_t *);
-    status (   *write)(connection *, char *, size_t, size_t *);
+    status (    *read)(connection *, char **, size_t *);
+    status ( *discard)(connection *, size_t, size_t *);
+    status (   *write)(connection *, struct iovec *, int, size_t *);
     size_t (*readable)(connection *);
 };
 // 定义了一个结构体sock ，在wrk.c 中有赋予变量
@@ -24,8 +25,10 @@ struct sock {
 
 status sock_connect(connection *, char *);
 status sock_close(connection *);
-status sock_read(connection *, size_t *);
-status sock_write(connection *, char *, size_t, size_t *);
+status sock_read(connection *, char **, size_t *);
+status sock_discard(connection *, size_t, size_t *);
+status sock_write(connection *, struct iovec *, int, size_t *);
 size_t sock_readable(connection *);
+void sock_errqueue(connection *);
 
 #endif /* NET_H */
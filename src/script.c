@@ -2,6 +2,11 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include "script.h"
 #include "http_parser.h"
 #include "zmalloc.h"
@@ -12,6 +17,7 @@ typedef struct {
     void *value;
 } table_field;
 
+static struct addrinfo *checkaddr(lua_State *);
 static int script_addr_tostring(lua_State *);
 static int script_addr_gc(lua_State *);
 static int script_stats_call(lua_State *);
@@ -20,7 +26,9 @@ static int script_stats_index(lua_State *);
 static int script_thread_index(lua_State *);
 static int script_thread_newindex(lua_State *);
 static int script_wrk_lookup(lua_State *);
+static int script_unix_lookup(lua_State *, const char *);
 static int script_wrk_connect(lua_State *);
+static int script_wrk_probe(lua_State *);
 
 static void set_fields(lua_State *, int, const table_field *);
 static void set_field(lua_State *, int, char *, int);
@@ -70,6 +78,7 @@ lua_State *script_create(char *file, char *url, char **headers) {
     const table_field fields[] = {
         { "lookup",  LUA_TFUNCTION, script_wrk_lookup  },
         { "connect", LUA_TFUNCTION, script_wrk_connect },
+        { "probe",   LUA_TFUNCTION, script_wrk_probe   },
         { "path",    LUA_TSTRING,   path               },
         { NULL,      0,             NULL               },
     };
@@ -151,19 +160,56 @@ uint64_t script_delay(lua_State *L) {
     return delay;
 }
 
-void script_request(lua_State *L, char **buf, size_t *len) {
-    int pop = 1;
+void script_request(lua_State *L, request *r) {
+    int top = lua_gettop(L);
     lua_getglobal(L, "request");
     if (!lua_isfunction(L, -1)) {
         lua_getglobal(L, "wrk");
         lua_getfield(L, -1, "request");
-        pop += 2;
     }
+    int base = lua_gettop(L) - 1;
+    lua_call(L, 0, LUA_MULTRET);
+
+    int count = lua_gettop(L) - base;
+    if (count > MAX_REQUEST_IOV) {
+        fprintf(stderr, "request() returned more than %d values\n", MAX_REQUEST_IOV);
+        exit(1);
+    }
+
+    r->iov    = realloc(r->iov, MAX(count, 1) * sizeof(struct iovec));
+    r->iovcnt = count;
+    r->length = 0;
+    for (int i = 0; i < count; i++) {
+        size_t len;
+        r->iov[i].iov_base = (char *) lua_tolstring(L, base + 1 + i, &len);
+        r->iov[i].iov_len  = len;
+        r->length += len;
+    }
+
+    // the strings are sent straight from Lua's memory, so keep a
+    // reference to them until the next request replaces them
+    script_release(L, r->ref);
+    lua_createtable(L, count, 0);
+    for (int i = 0; i < count; i++) {
+        lua_pushvalue(L, base + 1 + i);
+        lua_rawseti(L, -2, i + 1);
+    }
+    r->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_settop(L, top);
+}
+
+void script_message(lua_State *L, buffer *b) {
+    size_t len;
+    lua_getglobal(L, "message");
     lua_call(L, 0, 1);
-    const char *str = lua_tolstring(L, -1, len);
-    *buf = realloc(*buf, *len);
-    memcpy(*buf, str, *len);
-    lua_pop(L, pop);
+    const char *s = lua_tolstring(L, -1, &len);
+    buffer_append(b, s, len);
+    lua_pop(L, 1);
+}
+
+void script_release(lua_State *L, int ref) {
+    if (ref > 0) luaL_unref(L, LUA_REGISTRYINDEX, ref);
 }
 
 void script_response(lua_State *L, int status, buffer *headers, buffer *body) {
@@ -184,6 +230,94 @@ void script_response(lua_State *L, int status, buffer *headers, buffer *body) {
     buffer_reset(body);
 }
 
+// Fill in any socket option not already set from the command line, which
+// marks unset options with -1 or NULL, from the wrk.sockopt table.
+void script_sockopts(lua_State *L, sockopts *o) {
+    struct { char *name; int *value; } fields[] = {
+        { "rcvbuf",        &o->rcvbuf        },
+        { "sndbuf",        &o->sndbuf        },
+        { "notsent_lowat", &o->notsent_lowat },
+        { "maxseg",        &o->maxseg        },
+        { "tos",           &o->tos           },
+        { NULL,            NULL              },
+    };
+
+    lua_getglobal(L, "wrk");
+    lua_getfield(L, -1, "sockopt");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 2);
+        return;
+    }
+
+    for (int i = 0; fields[i].name; i++) {
+        lua_getfield(L, -1, fields[i].name);
+        if (*fields[i].value == -1 && lua_isnumber(L, -1)) {
+            *fields[i].value = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_getfield(L, -1, "quickack");
+    if (o->quickack == -1 && lua_isboolean(L, -1)) {
+        o->quickack = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "congestion");
+    if (!o->congestion && lua_isstring(L, -1)) {
+        o->congestion = strdup(lua_tostring(L, -1));
+    }
+    lua_pop(L, 3);
+}
+
+// The wrk.framing descriptor, if a script set one.
+char *script_framing(lua_State *L) {
+    char *framing = NULL;
+    lua_getglobal(L, "wrk");
+    lua_getfield(L, -1, "framing");
+    if (lua_isstring(L, -1)) framing = strdup(lua_tostring(L, -1));
+    lua_pop(L, 2);
+    return framing;
+}
+
+// Copy wrk.addrs into an array of targets. Weights are looked up in the
+// optional wrk.weights table by address with port, then without it, and
+// default to 1.
+size_t script_targets(lua_State *L, target **targets) {
+    lua_getglobal(L, "wrk");
+    lua_getfield(L, -1, "weights");
+    lua_getfield(L, -2, "addrs");
+
+    size_t count = lua_objlen(L, -1);
+    target *t = *targets = zcalloc(count * sizeof(target));
+
+    for (size_t i = 1; i <= count; i++, t++) {
+        lua_rawgeti(L, -1, i);
+        script_addr_copy(checkaddr(L), &t->addr);
+        script_addr_tostring(L);
+        t->name   = strdup(lua_tostring(L, -1));
+        t->weight = 1;
+
+        if (lua_istable(L, -4)) {
+            char *port = strrchr(t->name, ':');
+            lua_getfield(L, -4, t->name);
+            if (lua_isnil(L, -1) && port && t->addr.ai_family != AF_UNIX) {
+                lua_pop(L, 1);
+                lua_pushlstring(L, t->name, port - t->name);
+                lua_gettable(L, -5);
+            }
+            if (lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 1) {
+                t->weight = lua_tointeger(L, -1);
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 2);
+    }
+
+    lua_pop(L, 3);
+    return count;
+}
+
 bool script_is_function(lua_State *L, char *name) {
     lua_getglobal(L, name);
     bool is_function = lua_isfunction(L, -1);
@@ -203,6 +337,10 @@ bool script_has_delay(lua_State *L) {
     return script_is_function(L, "delay");
 }
 
+bool script_has_message(lua_State *L) {
+    return script_is_function(L, "message");
+}
+
 bool script_has_done(lua_State *L) {
     return script_is_function(L, "done");
 }
@@ -228,7 +366,8 @@ void script_errors(lua_State *L, errors *errors) {
         errors->read,
         errors->write,
         errors->status,
-        errors->timeout
+        errors->timeout,
+        errors->ports
     };
     const table_field fields[] = {
         { "connect", LUA_TNUMBER, &e[0] },
@@ -236,10 +375,27 @@ void script_errors(lua_State *L, errors *errors) {
         { "write",   LUA_TNUMBER, &e[2] },
         { "status",  LUA_TNUMBER, &e[3] },
         { "timeout", LUA_TNUMBER, &e[4] },
+        { "ports",   LUA_TNUMBER, &e[5] },
+        { NULL,      0,           NULL  },
+    };
+    uint64_t m[] = {
+        errors->mismatch.status,
+        errors->mismatch.length,
+        errors->mismatch.crc32,
+        errors->mismatch.body
+    };
+    const table_field mismatch[] = {
+        { "status",  LUA_TNUMBER, &m[0] },
+        { "length",  LUA_TNUMBER, &m[1] },
+        { "crc32",   LUA_TNUMBER, &m[2] },
+        { "body",    LUA_TNUMBER, &m[3] },
         { NULL,      0,           NULL  },
     };
     lua_newtable(L);
     set_fields(L, 2, fields);
+    lua_newtable(L);
+    set_fields(L, 3, mismatch);
+    lua_setfield(L, 2, "mismatch");
     lua_setfield(L, 1, "errors");
 }
 
@@ -272,10 +428,18 @@ size_t script_verify_request(lua_State *L) {
         .on_message_complete = verify_request
     };
     http_parser parser;
-    char *request = NULL;
-    size_t len, count = 0;
+    request r = { 0 };
+    size_t len = 0, count = 0;
+
+    script_request(L, &r);
+    char *request = zmalloc(r.length);
+    for (int i = 0; i < r.iovcnt; i++) {
+        memcpy(request + len, r.iov[i].iov_base, r.iov[i].iov_len);
+        len += r.iov[i].iov_len;
+    }
+    script_release(L, r.ref);
+    free(r.iov);
 
-    script_request(L, &request, &len);
     http_parser_init(&parser, HTTP_REQUEST);
     parser.data = &count;
 
@@ -299,6 +463,7 @@ size_t script_verify_request(lua_State *L) {
         exit(1);
     }
 
+    zfree(request);
     return count;
 }
 
@@ -327,6 +492,12 @@ static int script_addr_tostring(lua_State *L) {
     char host[NI_MAXHOST];
     char service[NI_MAXSERV];
 
+    if (addr->ai_family == AF_UNIX) {
+        struct sockaddr_un *sun = (struct sockaddr_un *) addr->ai_addr;
+        lua_pushfstring(L, "unix:%s", sun->sun_path);
+        return 1;
+    }
+
     int flags = NI_NUMERICHOST | NI_NUMERICSERV;
     int rc = getnameinfo(addr->ai_addr, addr->ai_addrlen, host, NI_MAXHOST, service, NI_MAXSERV, flags);
     if (rc != 0) {
@@ -449,10 +620,15 @@ static int script_wrk_lookup(lua_State *L) {
     const char *host    = lua_tostring(L, -2);
     const char *service = lua_tostring(L, -1);
 
+    if (host && *host == '/') {
+        return script_unix_lookup(L, host);
+    }
+
     if ((rc = getaddrinfo(host, service, &hints, &addrs)) != 0) {
         const char *msg = gai_strerror(rc);
         fprintf(stderr, "unable to resolve %s:%s %s\n", host, service, msg);
-        exit(1);
+        lua_newtable(L);
+        return 1;
     }
 
     lua_newtable(L);
@@ -465,14 +641,128 @@ static int script_wrk_lookup(lua_State *L) {
     return 1;
 }
 
+static int script_unix_lookup(lua_State *L, const char *path) {
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    struct addrinfo addr = {
+        .ai_family   = AF_UNIX,
+        .ai_socktype = SOCK_STREAM,
+        .ai_addrlen  = sizeof(sun),
+        .ai_addr     = (struct sockaddr *) &sun,
+    };
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "unix socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(sun.sun_path, path);
+
+    lua_newtable(L);
+    script_addr_clone(L, &addr);
+    lua_rawseti(L, -2, 1);
+    return 1;
+}
+
+static uint64_t probe_time_us() {
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return (t.tv_sec * 1000000) + t.tv_usec;
+}
+
+// Start a non-blocking connect to every address and wait for all of them,
+// or the timeout, in a single poll() loop. Each entry of times is set to
+// the connect time in microseconds or -1 if the connect failed.
+static void probe(struct addrinfo **addrs, size_t count, int timeout, int64_t *times) {
+    struct pollfd *fds = zcalloc(count * sizeof(struct pollfd));
+    uint64_t start = probe_time_us(), deadline = start + timeout * 1000;
+    size_t pending = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        struct addrinfo *addr = addrs[i];
+        int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+
+        times[i] = -1;
+        fds[i].fd     = -1;
+        fds[i].events = POLLOUT;
+        if (fd == -1) continue;
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+            times[i] = probe_time_us() - start;
+            close(fd);
+        } else if (errno == EINPROGRESS) {
+            fds[i].fd = fd;
+            pending++;
+        } else {
+            close(fd);
+        }
+    }
+
+    uint64_t now;
+    while (pending > 0 && (now = probe_time_us()) < deadline) {
+        if (poll(fds, count, (deadline - now + 999) / 1000) <= 0) continue;
+        now = probe_time_us();
+
+        for (size_t i = 0; i < count; i++) {
+            if (fds[i].fd == -1 || !fds[i].revents) continue;
+
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (!err) times[i] = now - start;
+
+            close(fds[i].fd);
+            fds[i].fd = -1;
+            pending--;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (fds[i].fd != -1) close(fds[i].fd);
+    }
+    zfree(fds);
+}
+
 static int script_wrk_connect(lua_State *L) {
+    int timeout = luaL_optint(L, 2, PROBE_TIMEOUT_MS);
+    lua_settop(L, 1);
     struct addrinfo *addr = checkaddr(L);
-    int fd, connected = 0;
-    if ((fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) != -1) {
-        connected = connect(fd, addr->ai_addr, addr->ai_addrlen) == 0;
-        close(fd);
+    int64_t time;
+
+    probe(&addr, 1, timeout, &time);
+    lua_pushboolean(L, time >= 0);
+    return 1;
+}
+
+static int script_wrk_probe(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int timeout = luaL_optint(L, 2, PROBE_TIMEOUT_MS);
+    size_t count = lua_objlen(L, 1);
+
+    if (count == 0) {
+        lua_newtable(L);
+        return 1;
+    }
+
+    struct addrinfo *addrs[count];
+    int64_t times[count];
+
+    for (size_t i = 0; i < count; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        addrs[i] = checkaddr(L);
+        lua_pop(L, 1);
+    }
+
+    probe(addrs, count, timeout, times);
+
+    lua_createtable(L, count, 0);
+    for (size_t i = 0; i < count; i++) {
+        if (times[i] >= 0) {
+            lua_pushnumber(L, times[i]);
+        } else {
+            lua_pushboolean(L, 0);
+        }
+        lua_rawseti(L, -2, i + 1);
     }
-    lua_pushboolean(L, connected);
     return 1;
 }
 
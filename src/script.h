@@ -17,17 +17,24 @@ void script_done(lua_State *, stats *, stats *);
 
 void script_init(lua_State *, thread *, int, char **);
 uint64_t script_delay(lua_State *);
-void script_request(lua_State *, char **, size_t *);
+void script_request(lua_State *, request *);
+void script_message(lua_State *, buffer *);
+void script_release(lua_State *, int);
 void script_response(lua_State *, int, buffer *, buffer *);
 size_t script_verify_request(lua_State *L);
+void script_sockopts(lua_State *, sockopts *);
+char *script_framing(lua_State *);
+size_t script_targets(lua_State *, target **);
 
 bool script_is_static(lua_State *);
 bool script_want_response(lua_State *L);
 bool script_has_delay(lua_State *L);
+bool script_has_message(lua_State *L);
 bool script_has_done(lua_State *L);
 void script_summary(lua_State *, uint64_t, uint64_t, uint64_t);
 void script_errors(lua_State *, errors *);
 
+void script_addr_copy(struct addrinfo *, struct addrinfo *);
 void script_copy_value(lua_State *, lua_State *, int);
 int script_parse_url(char *, struct http_parser_url *);
 
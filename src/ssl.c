@@ -42,15 +42,28 @@ SSL_CTX *ssl_init() {
             SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
             SSL_CTX_set_verify_depth(ctx, 0);
             SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY);
-            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
         }
     }
 
     return ctx;
 }
 
+// Keep the newest session, or TLS 1.3 ticket, of each connection so that
+// its next handshake can resume it.
+int ssl_new_session(SSL *ssl, SSL_SESSION *session) {
+    connection *c = SSL_get_app_data(ssl);
+    if (c->session) SSL_SESSION_free(c->session);
+    c->session  = session;
+    c->ticketed = true;
+    return 1;
+}
+
 status ssl_connect(connection *c, char *host) {
     int r;
+    // SSL_clear() leaves the last session in place, replace it so that
+    // only sessions kept by ssl_new_session() are resumed
+    if (SSL_in_before(c->ssl)) SSL_set_session(c->ssl, c->session);
     SSL_set_fd(c->ssl, c->fd);
     SSL_set_tlsext_host_name(c->ssl, host);
     if ((r = SSL_connect(c->ssl)) != 1) {
@@ -69,9 +82,10 @@ status ssl_close(connection *c) {
     return OK;
 }
 
-status ssl_read(connection *c, size_t *n) {
+status ssl_read(connection *c, char **buf, size_t *n) {
     int r;
-    if ((r = SSL_read(c->ssl, c->buf, sizeof(c->buf))) <= 0) {
+    *buf = c->thread->buf;
+    if ((r = SSL_read(c->ssl, c->thread->buf, c->thread->bufsize)) <= 0) {
         switch (SSL_get_error(c->ssl, r)) {
             case SSL_ERROR_WANT_READ:  return RETRY;
             case SSL_ERROR_WANT_WRITE: return RETRY;
@@ -82,9 +96,9 @@ status ssl_read(connection *c, size_t *n) {
     return OK;
 }
 
-status ssl_write(connection *c, char *buf, size_t len, size_t *n) {
+status ssl_discard(connection *c, size_t len, size_t *n) {
     int r;
-    if ((r = SSL_write(c->ssl, buf, len)) <= 0) {
+    if ((r = SSL_read(c->ssl, c->thread->buf, MIN(len, c->thread->bufsize))) <= 0) {
         switch (SSL_get_error(c->ssl, r)) {
             case SSL_ERROR_WANT_READ:  return RETRY;
             case SSL_ERROR_WANT_WRITE: return RETRY;
@@ -95,6 +109,24 @@ status ssl_write(connection *c, char *buf, size_t len, size_t *n) {
     return OK;
 }
 
+status ssl_write(connection *c, struct iovec *iov, int iovcnt, size_t *n) {
+    int r;
+    *n = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) continue;
+        if ((r = SSL_write(c->ssl, iov[i].iov_base, iov[i].iov_len)) <= 0) {
+            if (*n > 0) return OK;
+            switch (SSL_get_error(c->ssl, r)) {
+                case SSL_ERROR_WANT_READ:  return RETRY;
+                case SSL_ERROR_WANT_WRITE: return RETRY;
+                default:                   return ERROR;
+            }
+        }
+        *n += (size_t) r;
+    }
+    return OK;
+}
+
 size_t ssl_readable(connection *c) {
     return SSL_pending(c->ssl);
 }
@@ -4,11 +4,13 @@
 #include "net.h"
 
 SSL_CTX *ssl_init();
+int ssl_new_session(SSL *, SSL_SESSION *);
 
 status ssl_connect(connection *, char *);
 status ssl_close(connection *);
-status ssl_read(connection *, size_t *);
-status ssl_write(connection *, char *, size_t, size_t *);
+status ssl_read(connection *, char **, size_t *);
+status ssl_discard(connection *, size_t, size_t *);
+status ssl_write(connection *, struct iovec *, int, size_t *);
 size_t ssl_readable(connection *);
 
 #endif /* SSL_H */
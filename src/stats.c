@@ -30,6 +30,15 @@ int stats_record(stats *stats, uint64_t n) {
     return 1;
 }
 
+void stats_merge(stats *dst, stats *src) {
+    for (uint64_t i = src->min; i <= src->max; i++) {
+        dst->data[i] += src->data[i];
+    }
+    dst->count += src->count;
+    dst->min = MIN(dst->min, src->min);
+    dst->max = MAX(dst->max, src->max);
+}
+
 void stats_correct(stats *stats, int64_t expected) {
     for (uint64_t n = expected * 2; n <= stats->max; n++) {
         uint64_t count = stats->data[n];
@@ -40,6 +40,13 @@ typedef struct {
     uint32_t write;
     uint32_t status;
     uint32_t timeout;
+    uint32_t ports;
+    struct {
+        uint32_t status;
+        uint32_t length;
+        uint32_t crc32;
+        uint32_t body;
+    } mismatch;
 } errors;
 
 typedef struct {
@@ -56,6 +63,7 @@ stats *stats_alloc(uint64_t);
 void stats_free(stats *);
 
 int stats_record(stats *, uint64_t);
+void stats_merge(stats *, stats *);
 void stats_correct(stats *, int64_t);
 
 long double stats_mean(stats *);
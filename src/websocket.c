@@ -0,0 +1,148 @@
+// WebSocket framing, RFC 6455.
+//
+// Like http2.c this does no I/O. Server frames are parsed incrementally
+// and a callback runs as each frame ends. Client frames are built by
+// writing a header and masking the payload in place.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "websocket.h"
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+
+static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+void websocket_parser_init(websocket_parser *p, void *data) {
+    memset(p, 0, sizeof(*p));
+    p->data = data;
+}
+
+// Length of the frame header once its first two bytes are known.
+static size_t header_size(const uint8_t *h) {
+    switch (h[1] & 0x7f) {
+        case 126: return 4;
+        case 127: return 10;
+        default:  return 2;
+    }
+}
+
+static int begin_frame(websocket_parser *p) {
+    const uint8_t *h = p->header;
+
+    // servers must not mask, no extensions are negotiated
+    if ((h[0] & 0x70) || (h[1] & 0x80)) return -1;
+
+    p->fin    = h[0] & 0x80;
+    p->opcode = h[0] & 0x0f;
+    p->length = h[1] & 0x7f;
+
+    if (p->length == 126) {
+        p->length = h[2] << 8 | h[3];
+    } else if (p->length == 127) {
+        p->length = 0;
+        for (int i = 2; i < 10; i++) p->length = p->length << 8 | h[i];
+    }
+
+    switch (p->opcode) {
+        case 0x0: case WEBSOCKET_TEXT: case WEBSOCKET_BINARY:
+        case WEBSOCKET_CLOSE: case WEBSOCKET_PING: case WEBSOCKET_PONG:
+            break;
+        default:
+            return -1;
+    }
+
+    // control frames are short and never fragmented
+    if ((p->opcode & 0x8) && (p->length > WEBSOCKET_KEEP || !p->fin)) return -1;
+
+    p->remaining   = p->length;
+    p->payload_len = 0;
+    return 0;
+}
+
+// Parse received bytes, invoking cb at the end of each frame. Returns -1
+// on a protocol error, or the callback's result if it is not zero.
+int websocket_execute(websocket_parser *p, const char *data, size_t len, websocket_cb cb) {
+    const char *end = data + len;
+
+    while (data < end) {
+        if (p->header_len < 2 || p->header_len < header_size(p->header)) {
+            p->header[p->header_len++] = *data++;
+            if (p->header_len < 2 || p->header_len < header_size(p->header)) continue;
+            if (begin_frame(p)) return -1;
+        } else {
+            size_t n = MIN(p->remaining, (uint64_t) (end - data));
+            if (p->payload_len < WEBSOCKET_KEEP) {
+                size_t keep = MIN(n, WEBSOCKET_KEEP - p->payload_len);
+                memcpy(p->payload + p->payload_len, data, keep);
+                p->payload_len += keep;
+            }
+            p->remaining -= n;
+            data += n;
+        }
+
+        if (!p->remaining) {
+            int rc;
+            p->header_len = 0;
+            if ((rc = cb(p))) return rc;
+        }
+    }
+
+    return 0;
+}
+
+// Write a masked client frame header for a payload of len bytes, returning
+// its size, at most WEBSOCKET_HEADER.
+size_t websocket_header(uint8_t *h, uint8_t opcode, uint64_t len, uint32_t mask) {
+    size_t n = 2;
+
+    h[0] = 0x80 | opcode;
+    if (len < 126) {
+        h[1] = 0x80 | len;
+    } else if (len <= 0xffff) {
+        h[1] = 0x80 | 126;
+        h[n++] = len >> 8;
+        h[n++] = len;
+    } else {
+        h[1] = 0x80 | 127;
+        for (int i = 7; i >= 0; i--) h[n++] = len >> (i * 8);
+    }
+
+    memcpy(&h[n], &mask, 4);
+    return n + 4;
+}
+
+void websocket_mask(char *data, size_t len, uint32_t mask) {
+    uint8_t key[4];
+    size_t i = 0;
+
+    memcpy(key, &mask, 4);
+    for (; i + 4 <= len; i += 4) {
+        uint32_t v;
+        memcpy(&v, data + i, 4);
+        v ^= mask;
+        memcpy(data + i, &v, 4);
+    }
+    for (; i < len; i++) data[i] ^= key[i & 3];
+}
+
+// The Sec-WebSocket-Accept value a server must return for key.
+void websocket_accept(const char *key, char *accept) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len;
+    char buf[64];
+
+    snprintf(buf, sizeof(buf), "%s%s", key, guid);
+    EVP_Digest(buf, strlen(buf), digest, &len, EVP_sha1(), NULL);
+    EVP_EncodeBlock((unsigned char *) accept, digest, len);
+}
+
+// A random Sec-WebSocket-Key, 24 characters of base64.
+void websocket_key(char *key) {
+    unsigned char nonce[16];
+    RAND_bytes(nonce, sizeof(nonce));
+    EVP_EncodeBlock((unsigned char *) key, nonce, sizeof(nonce));
+}
@@ -0,0 +1,42 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WEBSOCKET_TEXT     0x1
+#define WEBSOCKET_BINARY   0x2
+#define WEBSOCKET_CLOSE    0x8
+#define WEBSOCKET_PING     0x9
+#define WEBSOCKET_PONG     0xa
+
+#define WEBSOCKET_KEEP     125
+#define WEBSOCKET_HEADER   14
+
+typedef struct websocket_parser websocket_parser;
+typedef int (*websocket_cb)(websocket_parser *);
+
+// Incremental parser for server frames. The first WEBSOCKET_KEEP bytes of
+// each frame's payload are kept, which holds any control frame whole.
+struct websocket_parser {
+    void    *data;
+    uint8_t  header[WEBSOCKET_HEADER];
+    size_t   header_len;
+    uint8_t  opcode;
+    bool     fin;
+    uint64_t length;
+    uint64_t remaining;
+    char     payload[WEBSOCKET_KEEP];
+    size_t   payload_len;
+};
+
+void websocket_parser_init(websocket_parser *, void *);
+int websocket_execute(websocket_parser *, const char *, size_t, websocket_cb);
+
+size_t websocket_header(uint8_t *, uint8_t, uint64_t, uint32_t);
+void websocket_mask(char *, size_t, uint32_t);
+void websocket_key(char *);
+void websocket_accept(const char *, char *);
+
+#endif /* WEBSOCKET_H */
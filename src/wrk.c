@@ -13,12 +13,58 @@ static struct config {
     uint64_t threads;
     uint64_t timeout;
     uint64_t pipeline;
+    uint64_t depth;
+    uint64_t units;
+    uint64_t inflight;
+    uint64_t requests_per_conn;
+    uint64_t recv_buf;
+    uint64_t resolve_interval;
+    uint64_t streams;
     bool     delay;
     bool     dynamic;
     bool     latency;
+    bool     conn_stats;
+    bool     busy_poll;
+    bool     zerocopy;
+    bool     rst_close;
+    bool     fastopen;
+    bool     discard;
+    bool     timestamps;
+    bool     h2;
+    bool     refill;
+    bool     response;
+    bool     websocket;
+    bool     no_resume;
+    bool     handshake;
+    enum {
+        BALANCE_NONE, BALANCE_RR, BALANCE_RANDOM, BALANCE_WEIGHTED
+    } balance;
     char    *host;
+    char    *socket;
     char    *script;
+    char    *ciphers;
+    char    *ciphersuites;
+    char    *groups;
+    char    *sigalgs;
+    int      tls_version;
     SSL_CTX *ctx;   //ssl context
+    sockopts sockopt;
+    expect   expect;
+    events   events;
+    framing  framing;
+    struct {
+        uint64_t rate;
+        char    *message;
+        bool     script;
+        buffer   handshake;
+        char     accept[32];
+    } ws;
+    struct {
+        struct sockaddr_storage addr;
+        socklen_t len;
+        uint32_t  count;
+        uint32_t  next;
+    } source;
 } cfg;
 // static代表全局的
 // 声明一个结构体struct config
@@ -29,6 +75,15 @@ static struct config {
 static struct {
     stats *latency;
     stats *requests;
+    stats *jitter;
+    stats *connect;
+    stats *network;
+    stats *overhead;
+    stats *first;
+    stats *gap;
+    stats *delay;
+    stats *full;
+    stats *resumed;
 } statistics;
 
 /*
@@ -54,6 +109,7 @@ static struct sock sock = {
     .connect  = sock_connect,
     .close    = sock_close,
     .read     = sock_read,
+    .discard  = sock_discard,
     .write    = sock_write,
     .readable = sock_readable
 };
@@ -65,10 +121,35 @@ static struct sock sock = {
 static struct http_parser_settings parser_settings = {
     .on_message_complete = response_complete
 };
+
+// consumes bytes read by socket_readable, chosen once in main
+static int (*read_responses)(connection *, char *, size_t) = parse_responses;
 // 同上 。只是变量名和定义的名称不一致
 
+static http2_settings h2_settings = {
+    .on_status = stream_status,
+    .on_close  = stream_close
+};
+
+
 
 
+static struct {
+    target_set *set;
+    target *all;
+} targets;
+
+static struct {
+    int captured;
+    int family;
+    sockopts values;
+    char congestion[16];
+} effective;
+
+static struct {
+    int captured;
+    char description[128];
+} negotiated;
 
 static volatile sig_atomic_t stop = 0;
 /*
@@ -104,7 +185,69 @@ static void usage() {
            "    -s, --script      <S>  Load Lua script file       \n"
            "    -H, --header      <H>  Add header to request      \n"
            "        --latency          Print latency statistics   \n"
+           "        --conn-stats       Print per-connection stats \n"
            "        --timeout     <T>  Socket/request timeout     \n"
+           "        --busy-poll        Spin instead of blocking   \n"
+           "        --zerocopy         Send with MSG_ZEROCOPY     \n"
+           "        --source-addrs <A>                            \n"
+           "                           Bind to source address A or\n"
+           "                           every address in range A-B \n"
+           "        --requests-per-conn <N>                       \n"
+           "                           Reconnect after N requests \n"
+           "        --rst-close        Close connections with RST \n"
+           "        --tcp-fastopen     Connect with TCP Fast Open \n"
+           "        --recv-buf    <N>  Size of each read          \n"
+           "        --timestamps       Split latency with kernel  \n"
+           "                           socket timestamps          \n"
+           "        --balance     <P>  Spread connections over all\n"
+           "                           addresses: rr, random or   \n"
+           "                           weighted                   \n"
+           "        --resolve-interval <T>                        \n"
+           "                           Re-resolve the host every T\n"
+           "        --pipeline    <N>  Pipeline N requests        \n"
+           "        --pipeline-refill  Send a request as each     \n"
+           "                           response arrives           \n"
+           "        --no-tls-resume    Full TLS handshake on every\n"
+           "                           connect                    \n"
+           "        --handshake        Measure TLS handshakes,    \n"
+           "                           closing after each one     \n"
+           "        --tls-version <V>  Use only TLS 1.2 or 1.3    \n"
+           "        --ciphers     <S>  TLS 1.2 cipher list        \n"
+           "        --ciphersuites <S> TLS 1.3 cipher suites      \n"
+           "        --groups      <S>  TLS key exchange groups    \n"
+           "        --sigalgs     <S>  TLS signature algorithms   \n"
+           "        --h2               Use HTTP/2, prior knowledge\n"
+           "                           for http and ALPN for https\n"
+           "        --streams     <N>  Concurrent HTTP/2 streams  \n"
+           "                           per connection             \n"
+           "        --websocket        Upgrade to WebSocket, also \n"
+           "                           implied by ws:// and wss://\n"
+           "        --ws-rate     <N>  Messages/sec per connection\n"
+           "        --ws-message  <S>  Static message payload     \n"
+           "        --framing     <D>  Frame non-HTTP responses:  \n"
+           "                           fixed:N, delim:S, resp or  \n"
+           "                           length:OFF:WIDTH[:le][:ADJ]\n"
+           "        --events      <M>  Time events in streaming   \n"
+           "                           responses: sse or lines    \n"
+           "        --event-time  <F>  Event field holding the    \n"
+           "                           server's send time         \n"
+           "                                                      \n"
+           "        --rcvbuf      <N>  Set SO_RCVBUF              \n"
+           "        --sndbuf      <N>  Set SO_SNDBUF              \n"
+           "        --quickack         Set TCP_QUICKACK           \n"
+           "        --notsent-lowat <N>                           \n"
+           "                           Set TCP_NOTSENT_LOWAT      \n"
+           "        --congestion  <S>  Set TCP_CONGESTION         \n"
+           "        --maxseg      <N>  Set TCP_MAXSEG             \n"
+           "        --tos         <N>  Set IP_TOS or IPV6_TCLASS  \n"
+           "        --expect-status <S>                           \n"
+           "                           Count responses with other \n"
+           "                           statuses, e.g. 200,3xx     \n"
+           "        --expect-length <N>                           \n"
+           "                           Expected body length       \n"
+           "        --expect-crc32 <X> Expected body CRC-32       \n"
+           "        --expect-body <S>  Expected body substring    \n"
+           "        --expect-regex <R> Expected body regex        \n"
            "    -v, --version          Print version details      \n"
            "                                                      \n"
            "  Numeric arguments may include a SI unit (1k, 1M, 1G)\n"
@@ -130,8 +273,23 @@ int main(int argc, char **argv) {
     char *port    = copy_url_part(url, &parts, UF_PORT);
     char *service = port ? port : schema;
 
+    if (!strcmp("ws", schema) || !strcmp("wss", schema)) {
+        cfg.websocket = true;
+        service = port ? port : schema[2] ? "https" : "http";
+    }
+
+    if (cfg.websocket && (cfg.h2 || cfg.depth > 1 || cfg.refill)) {
+        fprintf(stderr, "--websocket cannot be used with --h2 or --pipeline\n");
+        exit(1);
+    }
+
+    if ((cfg.events.mode || cfg.framing.type) && (cfg.h2 || cfg.websocket)) {
+        fprintf(stderr, "--events and --framing only apply to HTTP/1.1 connections\n");
+        exit(1);
+    }
+
 //如果是https
-    if (!strncmp("https", schema, 5)) {
+    if (!strncmp("https", schema, 5) || !strcmp("wss", schema)) {
         if ((cfg.ctx = ssl_init()) == NULL) {   //获取ssl环境
             fprintf(stderr, "unable to initialize SSL\n");
             ERR_print_errors_fp(stderr);
@@ -140,8 +298,30 @@ int main(int argc, char **argv) {
         sock.connect  = ssl_connect;
         sock.close    = ssl_close;
         sock.read     = ssl_read;
+        sock.discard  = ssl_discard;
         sock.write    = ssl_write;
         sock.readable = ssl_readable;
+        if (cfg.h2) SSL_CTX_set_alpn_protos(cfg.ctx, (unsigned char *) "\x02h2", 3);
+        if (cfg.no_resume) {
+            SSL_CTX_set_session_cache_mode(cfg.ctx, SSL_SESS_CACHE_OFF);
+        } else {
+            SSL_CTX_sess_set_new_cb(cfg.ctx, ssl_new_session);
+        }
+        if (cfg.tls_version) {
+            SSL_CTX_set_min_proto_version(cfg.ctx, cfg.tls_version);
+            SSL_CTX_set_max_proto_version(cfg.ctx, cfg.tls_version);
+        }
+        if ((cfg.ciphers      && !SSL_CTX_set_cipher_list(cfg.ctx, cfg.ciphers)) ||
+            (cfg.ciphersuites && !SSL_CTX_set_ciphersuites(cfg.ctx, cfg.ciphersuites)) ||
+            (cfg.groups       && !SSL_CTX_set1_groups_list(cfg.ctx, cfg.groups)) ||
+            (cfg.sigalgs      && !SSL_CTX_set1_sigalgs_list(cfg.ctx, cfg.sigalgs))) {
+            fprintf(stderr, "invalid TLS cipher, group or signature algorithm list\n");
+            ERR_print_errors_fp(stderr);
+            exit(1);
+        }
+    } else if (cfg.handshake) {
+        fprintf(stderr, "--handshake requires an https URL\n");
+        exit(1);
     }
 
 
@@ -152,34 +332,89 @@ int main(int argc, char **argv) {
 // 分配内存
     statistics.latency  = stats_alloc(cfg.timeout * 1000);
     statistics.requests = stats_alloc(MAX_THREAD_RATE_S);
+    statistics.jitter   = stats_alloc(MAX_POLL_JITTER_US);
+    statistics.connect  = stats_alloc(cfg.timeout * 1000);
+    statistics.network  = stats_alloc(cfg.timeout * 1000);
+    statistics.overhead = stats_alloc(cfg.timeout * 1000);
+    statistics.first    = stats_alloc(cfg.timeout * 1000);
+    statistics.gap      = stats_alloc(cfg.timeout * 1000);
+    statistics.delay    = stats_alloc(cfg.timeout * 1000);
+    statistics.full     = stats_alloc(cfg.timeout * 1000);
+    statistics.resumed  = stats_alloc(cfg.timeout * 1000);
     thread *threads     = zcalloc(cfg.threads * sizeof(thread));
 
 
     lua_State *L = script_create(cfg.script, url, headers);
-    if (!script_resolve(L, host, service)) {
+    char *target = cfg.socket ? cfg.socket : host;
+    if (!script_resolve(L, target, service)) {
         char *msg = strerror(errno);
-        fprintf(stderr, "unable to connect to %s:%s %s\n", host, service, msg);
+        fprintf(stderr, "unable to connect to %s:%s %s\n", target, service, msg);
         exit(1);
     }
 
     cfg.host = host;
 
+    if (cfg.balance) update_targets(L);
+
     for (uint64_t i = 0; i < cfg.threads; i++) {
         thread *t      = &threads[i];
-        t->loop        = aeCreateEventLoop(10 + cfg.connections * 3);
         t->connections = cfg.connections / cfg.threads;
+        t->loop        = aeCreateEventLoop(10 + t->connections * 3);
+        t->jitter      = cfg.busy_poll ? stats_alloc(MAX_POLL_JITTER_US) : NULL;
+        t->seed        = time_us() ^ i;
 
         t->L = script_create(cfg.script, url, headers);
         script_init(L, t, argc - optind, &argv[optind]);
 
         if (i == 0) {
-            cfg.pipeline = script_verify_request(t->L);
+            if (cfg.source.count && t->addr->ai_family != cfg.source.addr.ss_family) {
+                fprintf(stderr, "source address family does not match %s\n", host);
+                exit(1);
+            }
+            char *framing = cfg.framing.type ? NULL : script_framing(t->L);
+            if (framing && framing_parse(&cfg.framing, framing)) {
+                fprintf(stderr, "invalid wrk.framing: %s\n", framing);
+                exit(1);
+            }
+            free(framing);
+            if (cfg.framing.type && (cfg.h2 || cfg.websocket || cfg.events.mode)) {
+                fprintf(stderr, "wrk.framing cannot be used with --h2, --websocket or --events\n");
+                exit(1);
+            }
+            // raw requests are not HTTP, each request() result is taken
+            // to be one request
+            cfg.pipeline = cfg.framing.type ? 1 : script_verify_request(t->L);
             cfg.dynamic  = !script_is_static(t->L);
+            cfg.inflight = cfg.pipeline * cfg.depth;
+            // static lock-step batches are sent as a single request
+            // repeated, otherwise each request() result is sent in turn
+            if (!cfg.dynamic && !cfg.refill) {
+                cfg.pipeline = cfg.inflight;
+                cfg.units    = 1;
+            } else {
+                cfg.units    = cfg.depth;
+            }
             cfg.delay    = script_has_delay(t->L);
-            if (script_want_response(t->L)) {
+            cfg.response = script_want_response(t->L);
+            if (cfg.response) {
                 parser_settings.on_header_field = header_field;
                 parser_settings.on_header_value = header_value;
-                parser_settings.on_body         = response_body;
+                h2_settings.on_header           = stream_header;
+            }
+            if (cfg.response || cfg.expect.body || cfg.events.mode) {
+                parser_settings.on_body = response_body;
+                h2_settings.on_data     = stream_data;
+            }
+            cfg.discard = !parser_settings.on_body && !cfg.framing.type;
+            if (cfg.framing.type) {
+                read_responses = frame_protocol;
+            } else if (cfg.discard) {
+                read_responses = frame_responses;
+            }
+            script_sockopts(t->L, &cfg.sockopt);
+            if (cfg.websocket) {
+                cfg.ws.script = script_has_message(t->L);
+                ws_handshake(t->L);
             }
         }
 
@@ -198,15 +433,33 @@ int main(int argc, char **argv) {
     sigaction(SIGINT, &sa, NULL);
 
     char *time = format_time_s(cfg.duration);
-    printf("Running %s test @ %s\n", time, url);
+    printf("Running %s test @ %s\n", time, argv[optind]);
     printf("  %"PRIu64" threads and %"PRIu64" connections\n", cfg.threads, cfg.connections);
+    if (cfg.h2) printf("  HTTP/2, %"PRIu64" streams per connection\n", cfg.streams);
+    if (cfg.websocket && cfg.ws.rate) {
+        printf("  WebSocket, %"PRIu64" messages/sec per connection\n", cfg.ws.rate);
+    } else if (cfg.websocket) {
+        printf("  WebSocket, 1 message in flight per connection\n");
+    }
+    if (!cfg.h2 && cfg.inflight > 1) {
+        printf("  %"PRIu64" pipelined requests per connection%s\n", cfg.inflight,
+               cfg.refill ? ", refilled as responses arrive" : "");
+    }
 
     uint64_t start    = time_us();
     uint64_t complete = 0;
+    uint64_t connects = 0;
     uint64_t bytes    = 0;
+    uint64_t events   = 0;
+    uint64_t handshakes = 0;
+    uint64_t resumed  = 0;
     errors errors     = { 0 };
 
-    sleep(cfg.duration);
+    if (cfg.resolve_interval) {
+        resolve_until(L, target, service, start + cfg.duration * 1000000);
+    } else {
+        sleep(cfg.duration);
+    }
     stop = 1;
 
     for (uint64_t i = 0; i < cfg.threads; i++) {
@@ -214,43 +467,112 @@ int main(int argc, char **argv) {
         pthread_join(t->thread, NULL);
 
         complete += t->complete;
+        connects += t->connects;
         bytes    += t->bytes;
+        events   += t->events;
+        handshakes += t->handshakes;
+        resumed  += t->resumed;
 
         errors.connect += t->errors.connect;
         errors.read    += t->errors.read;
         errors.write   += t->errors.write;
         errors.timeout += t->errors.timeout;
         errors.status  += t->errors.status;
+        errors.ports   += t->errors.ports;
+
+        errors.mismatch.status += t->errors.mismatch.status;
+        errors.mismatch.length += t->errors.mismatch.length;
+        errors.mismatch.crc32  += t->errors.mismatch.crc32;
+        errors.mismatch.body   += t->errors.mismatch.body;
+
+        if (t->jitter) stats_merge(statistics.jitter, t->jitter);
+    }
+
+    for (target_set *set = targets.set, *prev; set; set = prev) {
+        prev = set->prev;
+        zfree(set->targets);
+        zfree(set);
     }
 
     uint64_t runtime_us = time_us() - start;
     long double runtime_s   = runtime_us / 1000000.0;
     long double req_per_s   = complete   / runtime_s;
+    long double conn_per_s  = connects   / runtime_s;
     long double bytes_per_s = bytes      / runtime_s;
 
-    if (complete / cfg.connections > 0) {
-        int64_t interval = runtime_us / (complete / cfg.connections);
+    // each HTTP/2 stream or pipeline slot issues requests back to back
+    // like a connection of its own
+    // messages sent at a fixed rate do not wait for earlier ones, so
+    // there are no missing samples to correct for
+    uint64_t senders = cfg.connections * (cfg.h2 ? cfg.streams : cfg.inflight);
+    if (complete / senders > 0 && !cfg.ws.rate) {
+        int64_t interval = runtime_us / (complete / senders);
         stats_correct(statistics.latency, interval);
     }
 
     print_stats_header();
     print_stats("Latency", statistics.latency, format_time_us);
     print_stats("Req/Sec", statistics.requests, format_metric);
-    if (cfg.latency) print_stats_latency(statistics.latency);
+    if (cfg.requests_per_conn) print_stats("Connect", statistics.connect, format_time_us);
+    if (cfg.handshake) {
+        print_stats("Full", statistics.full, format_time_us);
+        print_stats("Resumed", statistics.resumed, format_time_us);
+    }
+    if (cfg.timestamps) {
+        print_stats("Network", statistics.network, format_time_us);
+        print_stats("Overhead", statistics.overhead, format_time_us);
+        if (!cfg.h2 && cfg.inflight > 1) printf("    (split only when no request is left in flight)\n");
+    }
+    if (cfg.events.mode) {
+        print_stats("First", statistics.first, format_time_us);
+        print_stats("Gap", statistics.gap, format_time_us);
+        if (cfg.events.field) print_stats("Delay", statistics.delay, format_time_us);
+    }
+    if (cfg.latency) print_stats_latency("Latency", statistics.latency);
+    if (cfg.latency && cfg.events.mode) print_stats_latency("Gap", statistics.gap);
+    if (cfg.latency && cfg.events.field) print_stats_latency("Delay", statistics.delay);
+    if (cfg.latency && cfg.timestamps) print_stats_latency("Overhead", statistics.overhead);
+    if (cfg.latency && cfg.requests_per_conn) print_stats_latency("Connect", statistics.connect);
+    if (cfg.latency && cfg.handshake) {
+        print_stats_latency("Full Handshake", statistics.full);
+        print_stats_latency("Resumed Handshake", statistics.resumed);
+    }
+    if (cfg.conn_stats) print_stats_connections(threads);
+    for (uint64_t i = 0; i < cfg.threads; i++) zfree(threads[i].cs);
+    if (cfg.busy_poll)  print_stats_jitter(statistics.jitter);
+    if (cfg.balance)    print_stats_targets(runtime_s);
+    if (sockopts_set(&cfg.sockopt) && effective.captured) print_sockopts(&effective.values);
 
     char *runtime_msg = format_time_us(runtime_us);
 
-    printf("  %"PRIu64" requests in %s, %sB read\n", complete, runtime_msg, format_binary(bytes));
+    char *unit = cfg.websocket ? "messages" : "requests";
+    printf("  %"PRIu64" %s in %s, %sB read\n", complete, unit, runtime_msg, format_binary(bytes));
+    if (cfg.events.mode) printf("  %"PRIu64" events\n", events);
+    if (cfg.ctx && handshakes) {
+        printf("  %"PRIu64" TLS handshakes, %.2Lf%% resumed\n", handshakes, 100.0L * resumed / handshakes);
+    }
+    if (cfg.handshake && negotiated.captured) printf("  %s\n", negotiated.description);
     if (errors.connect || errors.read || errors.write || errors.timeout) {
         printf("  Socket errors: connect %d, read %d, write %d, timeout %d\n",
                errors.connect, errors.read, errors.write, errors.timeout);
     }
 
-    if (errors.status) {
+    if (errors.status && cfg.framing.type) {
+        printf("  Error replies: %d\n", errors.status);
+    } else if (errors.status) {
         printf("  Non-2xx or 3xx responses: %d\n", errors.status);
     }
 
+    if (errors.ports) {
+        printf("  Source ports exhausted: %d\n", errors.ports);
+    }
+
+    if (expect_any(&cfg.expect)) print_mismatches(&errors);
+
     printf("Requests/sec: %9.2Lf\n", req_per_s);
+    if (cfg.requests_per_conn) printf("Connections/sec: %6.2Lf\n", conn_per_s);
+    if (cfg.handshake) printf("Handshakes/sec: %7.2Lf\n", handshakes / runtime_s);
+    if (cfg.events.mode) printf("Events/sec: %11.2Lf\n", events / runtime_s);
     printf("Transfer/sec: %10sB\n", format_binary(bytes_per_s));
 
     if (script_has_done(L)) {
@@ -265,53 +587,236 @@ int main(int argc, char **argv) {
 void *thread_main(void *arg) {
     thread *thread = arg;
 
-    char *request = NULL;
-    size_t length = 0;
+    request request = { 0 };
+    http2_request *requests = NULL;
+    size_t count = 0;
 
-    if (!cfg.dynamic) {
-        script_request(thread->L, &request, &length);
+    if (!cfg.dynamic && !cfg.websocket) {
+        script_request(thread->L, &request);
+        if (!cfg.h2 && cfg.depth > 1 && cfg.units == 1) repeat_request(&request, cfg.depth);
+        if (cfg.h2 && !(requests = http2_convert(request.iov, request.iovcnt, cfg.ctx ? "https" : "http", &count))) {
+            fprintf(stderr, "request is not valid HTTP/1.1, cannot convert to HTTP/2\n");
+            exit(1);
+        }
     }
 
-    thread->cs = zcalloc(thread->connections * sizeof(connection));
+    thread->bufsize = cfg.recv_buf;
+    thread->buf     = zmalloc(thread->bufsize);
+
+    // on io_uring plain connections receive into a ring of buffers shared
+    // by the thread, timestamps and zerocopy need their own syscalls
+    if (!cfg.ctx && !cfg.timestamps && !cfg.zerocopy) {
+        uint64_t count = MIN(MAX(64, thread->connections * 2), RING_BUFFERS_MAX);
+        aeRingCreate(thread->loop, count, thread->bufsize);
+    }
+    thread->cs  = zcalloc(thread->connections * sizeof(connection));
     connection *c = thread->cs;
 
     for (uint64_t i = 0; i < thread->connections; i++, c++) {
         c->thread = thread;
         c->ssl     = cfg.ctx ? SSL_new(cfg.ctx) : NULL;
+        if (c->ssl) SSL_set_app_data(c->ssl, c);
         c->request = request;
-        c->length  = length;
         c->delayed = cfg.delay;
+        if (cfg.inflight > 1) c->sent = zcalloc(sizeof(sent_state) + cfg.inflight * sizeof(uint64_t));
+        if (cfg.framing.type) c->framing = zcalloc(sizeof(framing_state));
+        if (cfg.zerocopy) c->zerocopy = zcalloc(sizeof(zerocopy_state));
+        if (cfg.timestamps) c->timestamp = zcalloc(sizeof(timestamp_state));
+        if (cfg.websocket) c->ws = zcalloc(sizeof(ws_state));
+        if (expect_any(&cfg.expect)) c->expect = zcalloc(sizeof(expect_state));
+        if (cfg.events.mode) c->event = zcalloc(sizeof(event_state));
+        if (cfg.h2) {
+            c->h2 = zcalloc(sizeof(h2_state));
+            c->h2->session  = http2_new(&h2_settings, cfg.streams, c);
+            c->h2->streams  = zcalloc(cfg.streams * sizeof(stream));
+            c->h2->requests = requests;
+            c->h2->count    = count;
+            c->delayed     = false;
+        }
         connect_socket(thread, c);
     }
 
     aeEventLoop *loop = thread->loop;
     aeCreateTimeEvent(loop, RECORD_INTERVAL_MS, record_rate, thread, NULL);
+    if (cfg.websocket && cfg.ws.rate) aeCreateTimeEvent(loop, ws_interval(), ws_tick, thread, NULL);
 
     thread->start = time_us();
-    aeMain(loop);
+    if (cfg.busy_poll) {
+        busy_poll(thread);
+    } else {
+        aeMain(loop);
+    }
+
+    for (uint64_t i = 0; i < thread->connections; i++) {
+        connection *c = &thread->cs[i];
+        if (c->zerocopy) {
+            zerocopy_release(thread, c, true);
+            zfree(c->zerocopy->held);
+        }
+    }
 
+    thread->memory = aeGetMemoryUsage(loop) + thread->bufsize;
     aeDeleteEventLoop(loop);
-    zfree(thread->cs);
+    zfree(thread->buf);
 
     return NULL;
 }
 
+// Replace a static request with n copies of itself in one buffer so that a
+// whole pipeline batch goes out in a single write.
+static void repeat_request(request *r, uint64_t n) {
+    char *buf = zmalloc(r->length * n), *p = buf;
+
+    for (uint64_t i = 0; i < n; i++) {
+        for (int j = 0; j < r->iovcnt; j++) {
+            memcpy(p, r->iov[j].iov_base, r->iov[j].iov_len);
+            p += r->iov[j].iov_len;
+        }
+    }
+
+    r->iov[0] = (struct iovec) { buf, r->length * n };
+    r->iovcnt = 1;
+    r->length = r->length * n;
+}
+
+// Poll without ever blocking in the kernel, recording how long each pass
+// over the event loop takes. A response can wait up to one pass before it
+// is noticed, so this is the resolution of the latency measurement.
+static void busy_poll(thread *thread) {
+    aeEventLoop *loop = thread->loop;
+    uint64_t last = time_us();
+
+    loop->stop = 0;
+    while (!loop->stop) {
+        aeProcessEvents(loop, AE_ALL_EVENTS | AE_DONT_WAIT);
+        uint64_t now = time_us();
+        stats_record(thread->jitter, now - last);
+        last = now;
+    }
+}
+
+// Keep a request's strings alive until the kernel has completed every
+// zerocopy send issued before seq, completions arrive in send order.
+static void zerocopy_hold(connection *c, int ref, uint32_t seq) {
+    if (c->zerocopy->count == c->zerocopy->size) {
+        c->zerocopy->size = c->zerocopy->size ? c->zerocopy->size * 2 : 4;
+        c->zerocopy->held = zrealloc(c->zerocopy->held, c->zerocopy->size * sizeof(struct held));
+    }
+    c->zerocopy->held[c->zerocopy->count++] = (struct held) { ref, seq };
+}
+
+static void zerocopy_release(thread *thread, connection *c, bool all) {
+    uint32_t n = 0;
+    while (n < c->zerocopy->count) {
+        struct held *h = &c->zerocopy->held[n];
+        if (!all && (int32_t) (c->zerocopy->done - h->seq) < 0) break;
+        script_release(thread->L, h->ref);
+        n++;
+    }
+    c->zerocopy->count -= n;
+    memmove(c->zerocopy->held, c->zerocopy->held + n, c->zerocopy->count * sizeof(struct held));
+}
+
+// Whether a zerocopy send may still be reading a request's pages.
+static bool zerocopy_pending(connection *c) {
+    return c->zerocopy && c->zerocopy->sent != c->zerocopy->done;
+}
+
+static void errqueue_reap(thread *thread, connection *c) {
+    sock_errqueue(c);
+    if (c->zerocopy) zerocopy_release(thread, c, false);
+}
+
 static int connect_socket(thread *thread, connection *c) {
     struct addrinfo *addr = thread->addr;
     struct aeEventLoop *loop = thread->loop;
     int fd, flags;
 
+    if (cfg.balance) {
+        target_set *set = __atomic_load_n(&targets.set, __ATOMIC_ACQUIRE);
+        if (c->target) __sync_fetch_and_sub(&c->target->connections, 1);
+        c->target  = c->moving ? least_loaded(set) : pick_target(thread, set);
+        c->version = set->version;
+        c->moving  = false;
+        __sync_fetch_and_add(&c->target->connections, 1);
+        addr = &c->target->addr;
+    }
+    c->addr = addr;
+
     fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
 
     flags = fcntl(fd, F_GETFL, 0);
     fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 
+#ifdef TCP_FASTOPEN_CONNECT
+    if (cfg.fastopen && addr->ai_family != AF_UNIX) {
+        flags = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &flags, sizeof(flags));
+    }
+#endif
+
+    set_sockopts(fd, addr->ai_family);
+
+    if (cfg.source.count && bind_source(fd, addr->ai_family) == -1) {
+        if (errno == EADDRINUSE) goto ports;
+        goto error;
+    }
+
+    c->connect_start = time_us();
     if (connect(fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+        if (errno == EADDRNOTAVAIL) goto ports;
         if (errno != EINPROGRESS) goto error;
     }
 
-    flags = 1;
-    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags));
+    if (addr->ai_family != AF_UNIX) {
+        flags = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags));
+    }
+
+    if (c->zerocopy) {
+        zerocopy_release(thread, c, true);
+        c->zerocopy->sent = c->zerocopy->done = 0;
+        c->zerocopy->enabled = false;
+    }
+#ifdef SO_ZEROCOPY
+    if (c->zerocopy && !cfg.ctx && !cfg.h2 && !(cfg.dynamic && cfg.units > 1)) {
+        flags = 1;
+        c->zerocopy->enabled = !setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &flags, sizeof(flags));
+    }
+#endif
+
+    if (c->timestamp) c->timestamp->enabled = false;
+#if defined(SO_TIMESTAMPING) && defined(__linux__)
+    if (c->timestamp && !cfg.ctx && !cfg.h2) {
+        flags = SOF_TIMESTAMPING_SOFTWARE    | SOF_TIMESTAMPING_RX_SOFTWARE |
+                SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE |
+                SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                SOF_TIMESTAMPING_OPT_TSONLY;
+        c->timestamp->enabled = !setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+    }
+#endif
+
+#ifdef SO_BUSY_POLL
+    if (cfg.busy_poll) {
+        flags = BUSY_POLL_US;
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &flags, sizeof(flags));
+#ifdef SO_PREFER_BUSY_POLL
+        flags = 1;
+        setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &flags, sizeof(flags));
+#endif
+    }
+#endif
+
+    if (cfg.rst_close || cfg.handshake) {
+        struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+
+    c->served = 0;
+    if (c->h2) c->h2->ready = false;
+    if (c->ws) c->ws->open  = false;
+    c->ticketed = false;
+    c->deadline = 0;
 
     flags = AE_READABLE | AE_WRITABLE;
     if (aeCreateFileEvent(loop, fd, flags, socket_connected, c) == AE_OK) {
@@ -320,14 +825,258 @@ static int connect_socket(thread *thread, connection *c) {
         return fd;
     }
 
+  ports:
+    // ports are freed as other connections close, so try again shortly
+    // rather than losing the connection for the rest of the run
+    thread->errors.ports++;
+    aeCreateTimeEvent(loop, PORT_RETRY_MS, retry_connect, c, NULL);
+    goto done;
+
   error:
     thread->errors.connect++;
+
+  done:
+    if (c->target) __sync_fetch_and_sub(&c->target->connections, 1);
+    c->target   = NULL;
+    c->deadline = 0;
+    c->fd       = -1;
     close(fd);
     return -1;
 }
 
+static int retry_connect(aeEventLoop *loop, long long id, void *data) {
+    connection *c = data;
+    connect_socket(c->thread, c);
+    return AE_NOMORE;
+}
+
+// Bind to the next source address in round-robin order. The port is left
+// for connect() to choose so that each source address has its own full
+// ephemeral range per destination.
+static int bind_source(int fd, int family) {
+    struct sockaddr_storage ss = cfg.source.addr;
+    uint32_t n = __sync_fetch_and_add(&cfg.source.next, 1) % cfg.source.count;
+    uint32_t *low;
+    int flags = 1;
+
+    if (ss.ss_family == AF_INET) {
+        low = (uint32_t *) &((struct sockaddr_in *) &ss)->sin_addr;
+    } else {
+        low = (uint32_t *) &((struct sockaddr_in6 *) &ss)->sin6_addr.s6_addr[12];
+    }
+    *low = htonl(ntohl(*low) + n);
+
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    // Linux takes this at the IP level for IPv6 sockets as well, it has no
+    // IPv6 counterpart and the same number there is IPV6_MTU
+    int level = family == AF_INET6 ? SOL_IP : IPPROTO_IP;
+    setsockopt(fd, level, IP_BIND_ADDRESS_NO_PORT, &flags, sizeof(flags));
+#endif
+
+    return bind(fd, (struct sockaddr *) &ss, cfg.source.len);
+}
+
+static void set_sockopt(int fd, int level, int name, int value) {
+    if (value != -1) setsockopt(fd, level, name, &value, sizeof(value));
+}
+
+// Apply socket options before connect() so that the buffer sizes are used
+// for window scaling and the MSS is advertised in the SYN.
+static void set_sockopts(int fd, int family) {
+    sockopts *o = &cfg.sockopt;
+
+    set_sockopt(fd, SOL_SOCKET, SO_RCVBUF, o->rcvbuf);
+    set_sockopt(fd, SOL_SOCKET, SO_SNDBUF, o->sndbuf);
+    if (family == AF_UNIX) return;
+
+#ifdef TCP_QUICKACK
+    set_sockopt(fd, IPPROTO_TCP, TCP_QUICKACK, o->quickack);
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+    set_sockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, o->notsent_lowat);
+#endif
+    set_sockopt(fd, IPPROTO_TCP, TCP_MAXSEG, o->maxseg);
+    if (family == AF_INET6) {
+        set_sockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, o->tos);
+    } else {
+        set_sockopt(fd, IPPROTO_IP, IP_TOS, o->tos);
+    }
+#ifdef TCP_CONGESTION
+    if (o->congestion) {
+        setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, o->congestion, strlen(o->congestion));
+    }
+#endif
+}
+
+static int get_sockopt(int fd, int level, int name) {
+    int value = -1;
+    socklen_t len = sizeof(value);
+    getsockopt(fd, level, name, &value, &len);
+    return value;
+}
+
+// Record the values the kernel actually applied, which may differ from
+// those requested, e.g. Linux doubles buffer sizes.
+static void get_sockopts(int fd, int family) {
+    sockopts *o = &effective.values;
+
+    *o = (sockopts) { -1, -1, -1, -1, -1, -1, NULL };
+    effective.family = family;
+    o->rcvbuf = get_sockopt(fd, SOL_SOCKET, SO_RCVBUF);
+    o->sndbuf = get_sockopt(fd, SOL_SOCKET, SO_SNDBUF);
+    if (family == AF_UNIX) return;
+
+#ifdef TCP_QUICKACK
+    o->quickack = get_sockopt(fd, IPPROTO_TCP, TCP_QUICKACK);
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+    o->notsent_lowat = get_sockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT);
+#endif
+    o->maxseg = get_sockopt(fd, IPPROTO_TCP, TCP_MAXSEG);
+    if (family == AF_INET6) {
+        o->tos = get_sockopt(fd, IPPROTO_IPV6, IPV6_TCLASS);
+    } else {
+        o->tos = get_sockopt(fd, IPPROTO_IP, IP_TOS);
+    }
+#ifdef TCP_CONGESTION
+    socklen_t len = sizeof(effective.congestion) - 1;
+    if (!getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, effective.congestion, &len)) {
+        o->congestion = effective.congestion;
+    }
+#endif
+}
+
+static bool same_addr(struct addrinfo *a, struct addrinfo *b) {
+    return a->ai_addrlen == b->ai_addrlen && !memcmp(a->ai_addr, b->ai_addr, a->ai_addrlen);
+}
+
+// Rebuild the target set from wrk.addrs. Addresses seen before keep their
+// statistics. A new set is only published when membership or weights
+// changed. Replaced sets may still be read by threads picking a target,
+// so they are chained to the new one and freed once the threads exit.
+static void update_targets(lua_State *L) {
+    target_set *old = targets.set, *set;
+    target *fresh;
+    size_t count = script_targets(L, &fresh);
+    bool changed = !old || old->count != count;
+
+    if (!count) {
+        zfree(fresh);
+        return;
+    }
+
+    set = zcalloc(sizeof(target_set));
+    set->count   = count;
+    set->targets = zcalloc(count * sizeof(target *));
+    set->prev    = old;
+
+    for (target *t = targets.all; t; t = t->next) t->active = false;
+
+    for (size_t i = 0; i < count; i++) {
+        target *f = &fresh[i], *t, **last = &targets.all;
+
+        for (t = targets.all; t && !same_addr(&t->addr, &f->addr); t = t->next) {
+            last = &t->next;
+        }
+
+        if (!t) {
+            t = zmalloc(sizeof(target));
+            *t = *f;
+            *last = t;
+        } else {
+            changed |= t->weight != f->weight;
+            t->weight = f->weight;
+            zfree(f->addr.ai_addr);
+            free(f->name);
+        }
+
+        if (!changed && old->targets[i] != t) changed = true;
+        t->active = true;
+        set->targets[i] = t;
+        set->weight += target_weight(t);
+    }
+    zfree(fresh);
+
+    if (!changed) {
+        zfree(set->targets);
+        zfree(set);
+        return;
+    }
+
+    set->version = old ? old->version + 1 : 0;
+    __atomic_store_n(&targets.set, set, __ATOMIC_RELEASE);
+}
+
+static void resolve_until(lua_State *L, char *host, char *service, uint64_t deadline) {
+    uint64_t now;
+
+    while (!stop && (now = time_us()) < deadline) {
+        usleep(MIN(cfg.resolve_interval * 1000000, deadline - now));
+        if (stop || time_us() >= deadline) break;
+        if (script_resolve(L, host, service)) update_targets(L);
+    }
+}
+
+static uint64_t target_weight(target *t) {
+    return cfg.balance == BALANCE_WEIGHTED ? t->weight : 1;
+}
+
+// Fewest connections relative to weight.
+static target *least_loaded(target_set *set) {
+    target *best = set->targets[0];
+
+    for (size_t i = 1; i < set->count; i++) {
+        target *t = set->targets[i];
+        if ((t->connections + 1) * target_weight(best) < (best->connections + 1) * target_weight(t)) {
+            best = t;
+        }
+    }
+    return best;
+}
+
+static target *pick_target(thread *thread, target_set *set) {
+    switch (cfg.balance) {
+        case BALANCE_RR:
+            return set->targets[__sync_fetch_and_add(&set->next, 1) % set->count];
+        case BALANCE_RANDOM:
+            return set->targets[rand_r(&thread->seed) % set->count];
+        case BALANCE_WEIGHTED:
+            return least_loaded(set);
+        default:
+            return set->targets[0];
+    }
+}
+
+// Decide once per address set change whether a connection leaves its
+// target: when the address was removed, or when the target would still
+// hold at least its share of connections without this one. The rest stay
+// put, and the connections that move go to the least loaded targets.
+static bool target_moved(connection *c) {
+    if (!c->target) return false;
+    if (c->moving)  return true;
+
+    target_set *set = __atomic_load_n(&targets.set, __ATOMIC_ACQUIRE);
+    if (c->version == set->version) return false;
+
+    target *t = c->target;
+    c->version = set->version;
+    c->moving  = !t->active || (t->connections - 1) * set->weight >= cfg.connections * target_weight(t);
+    return c->moving;
+}
+
+static void target_record(target *t, uint64_t latency) {
+    uint64_t max = t->latency_max;
+
+    __sync_fetch_and_add(&t->complete, 1);
+    __sync_fetch_and_add(&t->latency, latency);
+    while (latency > max && !__sync_bool_compare_and_swap(&t->latency_max, max, latency)) {
+        max = t->latency_max;
+    }
+}
+
 static int reconnect_socket(thread *thread, connection *c) {
     aeDeleteFileEvent(thread->loop, c->fd, AE_WRITABLE | AE_READABLE);
+    c->reconnects++;
     sock.close(c);
     close(c->fd);
     return connect_socket(thread, c);
@@ -346,6 +1095,7 @@ static int record_rate(aeEventLoop *loop, long long id, void *data) {
         thread->start    = time_us();
     }
 
+    if (cfg.handshake) handshake_sweep(thread);
     if (stop) aeStop(loop);
 
     return RECORD_INTERVAL_MS;
@@ -354,7 +1104,7 @@ static int record_rate(aeEventLoop *loop, long long id, void *data) {
 static int delay_request(aeEventLoop *loop, long long id, void *data) {
     connection *c = data;
     c->delayed = false;
-    aeCreateFileEvent(loop, c->fd, AE_WRITABLE, socket_writeable, c);
+    socket_writeable(loop, c->fd, c, AE_NONE);
     return AE_NOMORE;
 }
 
@@ -380,46 +1130,237 @@ static int header_value(http_parser *parser, const char *at, size_t len) {
 
 static int response_body(http_parser *parser, const char *at, size_t len) {
     connection *c = parser->data;
-    buffer_append(&c->body, at, len);
+    if (cfg.events.mode) record_events(c, at, len);
+    if (cfg.expect.body) expect_body(&cfg.expect, c->expect, at, len);
+    if (cfg.response) buffer_append(&c->body, at, len);
     return 0;
 }
 
+// Time each event in a streaming response, the first from when the request
+// was sent and the rest from the event before. With --event-time the delay
+// from the server's timestamp is recorded too, which assumes synchronized
+// clocks.
+static void record_events(connection *c, const char *at, size_t len) {
+    thread *thread = c->thread;
+    event_state *s = c->event;
+    uint64_t now, time;
+    bool complete;
+
+    while (len) {
+        size_t n = events_next(&cfg.events, s, at, len, &complete);
+        at  += n;
+        len -= n;
+        if (!complete) continue;
+
+        now = time_us();
+        thread->events++;
+        if (s->count++) {
+            stats_record(statistics.gap, now - s->last);
+        } else {
+            stats_record(statistics.first, now - c->start);
+        }
+        s->last = now;
+
+        if (cfg.events.field && events_time(&cfg.events, s, &time) && time <= now) {
+            stats_record(statistics.delay, now - time);
+        }
+    }
+}
+
 static int response_complete(http_parser *parser) {
     connection *c = parser->data;
+    int status = parser->status_code;
+    bool keep_alive = http_should_keep_alive(parser);
+
+    http_parser_init(parser, HTTP_RESPONSE);
+    if (c->parsing) {
+        // stop here and give the rest of the buffer back to the framer
+        c->parsing = false;
+        http_parser_pause(parser, 1);
+    }
+
+    if (c->event) events_reset(c->event);
+    message_complete(c, status, keep_alive);
+    return 0;
+}
+
+static void message_complete(connection *c, int status, bool keep_alive) {
     thread *thread = c->thread;
     uint64_t now = time_us();
-    int status = parser->status_code;
 
     thread->complete++;
     thread->requests++;
+    c->complete++;
 
     if (status > 399) {
         thread->errors.status++;
     }
 
+    if (expect_any(&cfg.expect)) {
+        expect_check(&cfg.expect, c->expect, status, &thread->errors);
+    }
+
     if (c->headers.buffer) {
         *c->headers.cursor++ = '\0';
         script_response(thread->L, status, &c->headers, &c->body);
         c->state = FIELD;
     }
 
-    if (--c->pending == 0) {
-        if (!stats_record(statistics.latency, now - c->start)) {
+    if (c->pending > 0) {
+        uint64_t start = c->sent ? c->sent->times[c->sent->head++ % cfg.inflight] : c->start;
+        uint64_t latency = now - start;
+        if (!stats_record(statistics.latency, latency)) {
             thread->errors.timeout++;
         }
-        c->delayed = cfg.delay;
-        aeCreateFileEvent(thread->loop, c->fd, AE_WRITABLE, socket_writeable, c);
+        c->latency_max = MAX(c->latency_max, latency);
+        if (c->target) target_record(c->target, latency);
+
+        if (--c->pending == 0) {
+            c->delayed = cfg.delay;
+            if (c->timestamp && c->timestamp->enabled) record_timestamps(c, latency);
+        }
     }
 
-    if (!http_should_keep_alive(parser)) {
+    c->served++;
+
+    if (!keep_alive) {
         reconnect_socket(thread, c);
-        goto done;
+        return;
     }
 
-    http_parser_init(parser, HTTP_RESPONSE);
+    if (c->pending == 0 && cfg.requests_per_conn && c->served >= cfg.requests_per_conn) {
+        reconnect_socket(thread, c);
+        return;
+    }
 
-  done:
-    return 0;
+    if (c->pending == 0 && target_moved(c)) {
+        reconnect_socket(thread, c);
+        return;
+    }
+
+    if (cfg.refill) {
+        // replace each request() result once all of its responses are in,
+        // unless the connection is about to be closed
+        bool draining = (cfg.requests_per_conn && c->served + c->pending >= cfg.requests_per_conn) ||
+                        target_moved(c);
+        if (c->served % cfg.pipeline == 0 && !draining) {
+            c->delayed = cfg.delay;
+            if (c->queued++ == 0 && !c->written) socket_writeable(thread->loop, c->fd, c, AE_NONE);
+        }
+    } else if (c->pending == 0) {
+        c->queued = cfg.units;
+        socket_writeable(thread->loop, c->fd, c, AE_NONE);
+    }
+}
+
+// Split a request's latency at the kernel timestamps of the request leaving
+// and the response arriving. The remainder is time spent in wrk itself.
+// When no transmit timestamp was seen the send time in wrk is used instead.
+// Hardware timestamps are on the NIC's clock and are only compared to each
+// other. Timestamps are per read and write, not per request, so with
+// pipelining only the last response of a batch can be split.
+static void record_timestamps(connection *c, uint64_t latency) {
+    timestamp_state *ts = c->timestamp;
+    uint64_t sent = c->start;
+    uint64_t rcvd = ts->rx;
+
+    if (ts->rx_hardware) {
+        if (!ts->tx_hardware) return;
+        sent = ts->tx;
+    } else if (!ts->tx_hardware) {
+        sent = MAX(ts->tx, c->start);
+    }
+
+    if (rcvd < sent || rcvd - sent > latency) return;
+
+    stats_record(statistics.network,  rcvd - sent);
+    stats_record(statistics.overhead, latency - (rcvd - sent));
+}
+
+// Record the handshake, timed from connect(), and close the connection
+// unless --requests-per-conn asks for requests to be sent first. A TLS 1.3
+// server sends session tickets after the handshake, so when there is no
+// ticket yet one is waited for, for at most --timeout.
+static void handshake_complete(connection *c) {
+    thread *thread = c->thread;
+    bool reused = SSL_session_reused(c->ssl);
+    uint64_t now = time_us();
+
+    if (!stats_record(reused ? statistics.resumed : statistics.full, now - c->connect_start)) {
+        thread->errors.timeout++;
+    }
+
+    if (__sync_bool_compare_and_swap(&negotiated.captured, 0, 1)) {
+        describe_tls(c->ssl, negotiated.description, sizeof(negotiated.description));
+    }
+
+    if (cfg.requests_per_conn) return;
+
+    if (!cfg.no_resume && !c->ticketed && SSL_version(c->ssl) == TLS1_3_VERSION) {
+        c->deadline = now + cfg.timeout * 1000;
+        aeCreateFileEvent(thread->loop, c->fd, AE_READABLE, handshake_readable, c);
+        aeDeleteFileEvent(thread->loop, c->fd, AE_WRITABLE);
+        return;
+    }
+
+    reconnect_socket(thread, c);
+}
+
+static void handshake_readable(aeEventLoop *loop, int fd, void *data, int mask) {
+    connection *c = data;
+    status status;
+    char *buf;
+    size_t n;
+
+    do {
+        status = sock.read(c, &buf, &n);
+    } while (status == OK && n > 0 && !c->ticketed);
+
+    if (status == RETRY && !c->ticketed) return;
+    reconnect_socket(c->thread, c);
+}
+
+// Give up on tickets that have not arrived in time.
+static void handshake_sweep(thread *thread) {
+    uint64_t now = time_us();
+
+    for (uint64_t i = 0; i < thread->connections; i++) {
+        connection *c = &thread->cs[i];
+        if (c->deadline && now > c->deadline) {
+            thread->errors.timeout++;
+            reconnect_socket(thread, c);
+        }
+    }
+}
+
+// e.g. TLSv1.3 TLS_AES_256_GCM_SHA384, group X25519, rsaEncryption certificate
+static void describe_tls(SSL *ssl, char *buf, size_t len) {
+    const char *group = "unknown";
+    const char *key = "unknown";
+
+    // the negotiated group is only exposed from OpenSSL 3.0 on
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    int nid;
+    if ((nid = SSL_get_negotiated_group(ssl)) != NID_undef) {
+        group = (nid & TLSEXT_nid_unknown) ? "unknown" : OBJ_nid2sn(nid);
+    }
+
+    X509 *cert = SSL_get1_peer_certificate(ssl);
+#else
+    X509 *cert = SSL_get_peer_certificate(ssl);
+#endif
+    if (cert) {
+        EVP_PKEY *pkey = X509_get0_pubkey(cert);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        if (pkey) key = OBJ_nid2sn(EVP_PKEY_get_base_id(pkey));
+#else
+        if (pkey) key = OBJ_nid2sn(EVP_PKEY_base_id(pkey));
+#endif
+        X509_free(cert);
+    }
+
+    snprintf(buf, len, "%s %s, group %s, %s certificate",
+             SSL_get_version(ssl), SSL_get_cipher_name(ssl), group, key);
 }
 
 static void socket_connected(aeEventLoop *loop, int fd, void *data, int mask) {
@@ -431,8 +1372,83 @@ static void socket_connected(aeEventLoop *loop, int fd, void *data, int mask) {
         case RETRY: return;
     }
 
+    if (!c->ssl) {
+        // HTTP/2 and WebSocket reuse their output buffers right away
+        int flags = cfg.h2 || cfg.websocket ? AE_RING_COPY : 0;
+        c->ring = aeRingAttach(loop, fd, flags) == AE_OK;
+    }
+
+    stats_record(statistics.connect, time_us() - c->connect_start);
+    c->thread->connects++;
+    if (c->ssl) {
+        c->thread->handshakes++;
+        if (SSL_session_reused(c->ssl)) c->thread->resumed++;
+    }
+
+    if (cfg.handshake) {
+        handshake_complete(c);
+        if (!cfg.requests_per_conn) return;
+    }
+
+    if (__sync_bool_compare_and_swap(&effective.captured, 0, 1)) {
+        get_sockopts(fd, c->addr->ai_family);
+    }
+
+    if (cfg.h2) {
+        const unsigned char *proto = NULL;
+        unsigned int len = 0;
+
+        if (c->ssl) SSL_get0_alpn_selected(c->ssl, &proto, &len);
+        if (c->ssl && (len != 2 || memcmp(proto, "h2", 2))) {
+            static int warned = 0;
+            if (__sync_bool_compare_and_swap(&warned, 0, 1)) {
+                fprintf(stderr, "server did not negotiate h2 with ALPN\n");
+            }
+            goto error;
+        }
+
+        http2_reset(c->h2->session);
+        for (uint64_t i = 0; i < cfg.streams; i++) {
+            stream *s = &c->h2->streams[i];
+            s->id = 0;
+            buffer_reset(&s->headers);
+            buffer_reset(&s->body);
+            expect_reset(&s->expect);
+        }
+        c->h2->submitted = 0;
+        c->h2->ready     = true;
+
+        aeCreateFileEvent(c->thread->loop, fd, AE_READABLE, streams_readable, c);
+        aeDeleteFileEvent(c->thread->loop, fd, AE_WRITABLE);
+        submit_streams(c);
+        if (flush_streams(c)) goto error;
+        return;
+    }
+
+    if (cfg.websocket) {
+        websocket_parser_init(&c->ws->parser, c);
+        buffer_reset(&c->ws->in);
+        buffer_reset(&c->ws->out);
+        buffer_append(&c->ws->out, cfg.ws.handshake.buffer, cfg.ws.handshake.cursor - cfg.ws.handshake.buffer);
+        c->ws->written = 0;
+        c->ws->waiting = false;
+
+        aeCreateFileEvent(c->thread->loop, fd, AE_READABLE, ws_readable, c);
+        aeDeleteFileEvent(c->thread->loop, fd, AE_WRITABLE);
+        if (ws_flush(c)) goto error;
+        return;
+    }
+
     http_parser_init(&c->parser, HTTP_RESPONSE);
+    http_framer_init(&c->framer);
+    if (c->framing) framing_init(&cfg.framing, c->framing);
+    if (c->expect) expect_reset(c->expect);
+    if (c->event) events_reset(c->event);
+    if (c->sent) c->sent->head = c->sent->tail = 0;
+    c->parsing = false;
     c->written = 0;
+    c->pending = 0;
+    c->queued  = cfg.units;
 
     aeCreateFileEvent(c->thread->loop, fd, AE_READABLE, socket_readable, c);
     aeCreateFileEvent(c->thread->loop, fd, AE_WRITABLE, socket_writeable, c);
@@ -444,41 +1460,84 @@ static void socket_connected(aeEventLoop *loop, int fd, void *data, int mask) {
     reconnect_socket(c->thread, c);
 }
 
+// Called with AE_NONE when a request is sent directly from the response or
+// delay path, writable interest is only registered if the write would block.
 static void socket_writeable(aeEventLoop *loop, int fd, void *data, int mask) {
     connection *c = data;
     thread *thread = c->thread;
 
+    if (!c->queued) {
+        if (mask) aeDeleteFileEvent(loop, fd, AE_WRITABLE);
+        return;
+    }
+
     if (c->delayed) {
         uint64_t delay = script_delay(thread->L);
-        aeDeleteFileEvent(loop, fd, AE_WRITABLE);
+        if (mask) aeDeleteFileEvent(loop, fd, AE_WRITABLE);
         aeCreateTimeEvent(loop, delay, delay_request, c, NULL);
         return;
     }
 
+  next:
     if (!c->written) {
         if (cfg.dynamic) {
-            script_request(thread->L, &c->request, &c->length);
+            // an io_uring send reads the request in place, wait for it
+            // before request() replaces it
+            if (c->ring && aeRingWriting(loop, fd)) goto retry;
+            // the kernel may still be reading the previous request's
+            // pages, so keep them alive until the send completes
+            if (zerocopy_pending(c)) {
+                zerocopy_hold(c, c->request.ref, c->zerocopy->sent);
+                c->request.ref = 0;
+            }
+            script_request(thread->L, &c->request);
         }
-        c->start   = time_us();
-        c->pending = cfg.pipeline;
-    }
+        if (!c->request.length) goto error;
+        c->start    = time_us();
+        c->pending += cfg.pipeline;
+        for (uint64_t i = 0; c->sent && i < cfg.pipeline; i++) {
+            c->sent->times[c->sent->tail++ % cfg.inflight] = c->start;
+        }
+        if (c->timestamp) {
+            c->timestamp->tx = c->timestamp->rx = 0;
+            c->timestamp->tx_hardware = c->timestamp->rx_hardware = false;
+        }
+    }
 
-    char  *buf = c->request + c->written;
-    size_t len = c->length  - c->written;
-    size_t n;
+    struct iovec iov[MAX_REQUEST_IOV];
+    size_t skip = c->written, n;
+    int count = 0;
 
-    switch (sock.write(c, buf, len, &n)) {
+    for (int i = 0; i < c->request.iovcnt; i++) {
+        struct iovec *v = &c->request.iov[i];
+        if (skip >= v->iov_len) {
+            skip -= v->iov_len;
+            continue;
+        }
+        iov[count].iov_base = (char *) v->iov_base + skip;
+        iov[count].iov_len  = v->iov_len - skip;
+        count++;
+        skip = 0;
+    }
+
+    switch (sock.write(c, iov, count, &n)) {
         case OK:    break;
         case ERROR: goto error;
-        case RETRY: return;
+        case RETRY: goto retry;
     }
 
     c->written += n;
-    if (c->written == c->length) {
+    if (zerocopy_pending(c)) errqueue_reap(thread, c);
+    if (c->written == c->request.length) {
         c->written = 0;
-        aeDeleteFileEvent(loop, fd, AE_WRITABLE);
+        if (--c->queued) goto next;
+        if (mask) aeDeleteFileEvent(loop, fd, AE_WRITABLE);
+        return;
     }
 
+  retry:
+    if (!mask) aeCreateFileEvent(loop, fd, AE_WRITABLE, socket_writeable, c);
+
     return;
 
   error:
@@ -488,20 +1547,61 @@ static void socket_writeable(aeEventLoop *loop, int fd, void *data, int mask) {
 
 static void socket_readable(aeEventLoop *loop, int fd, void *data, int mask) {
     connection *c = data;
-    size_t n;
+    size_t n, want;
+    char *buf;
+
+    if ((c->timestamp && c->timestamp->enabled) || zerocopy_pending(c)) {
+        errqueue_reap(c->thread, c);
+    }
 
     do {
-        switch (sock.read(c, &n)) {
-            case OK:    break;
-            case ERROR: goto error;
-            case RETRY: return;
+        // without a response() callback body bytes are never looked at, so
+        // skip all but the last byte of a sized body or chunk and let the
+        // parser see that one to complete the message
+        uint64_t skip = 0;
+        if (cfg.discard) {
+            skip = c->parsing ? http_body_remaining(&c->parser) : http_framer_remaining(&c->framer);
+        }
+        want = c->thread->bufsize;
+
+        buf = NULL;
+        if (skip > 1) {
+            want = MIN(skip - 1, SIZE_MAX);
+            switch (sock.discard(c, want, &n)) {
+                case OK:    break;
+                case ERROR: goto error;
+                case RETRY: return;
+            }
+            if (n == 0) goto error;
+            if (c->parsing) {
+                http_body_skip(&c->parser, n);
+            } else {
+                c->framer.remaining -= n;
+            }
+        } else {
+            switch (sock.read(c, &buf, &n)) {
+                case OK:    break;
+                case ERROR: goto error;
+                case RETRY: return;
+            }
         }
 
-        if (http_parser_execute(&c->parser, &parser_settings, c->buf, n) != n) goto error;
-        if (n == 0 && !http_body_is_final(&c->parser)) goto error;
-
+        uint64_t reconnects = c->reconnects;
         c->thread->bytes += n;
-    } while (n == RECVBUF && sock.readable(c) > 0);
+        c->bytes += n;
+        if (c->target) __sync_fetch_and_add(&c->target->bytes, n);
+
+        if (buf && read_responses(c, buf, n)) goto error;
+        if (c->reconnects != reconnects) return;
+    } while (n == want && sock.readable(c) > 0);
+
+#ifdef TCP_QUICKACK
+    // quick ack mode is not sticky, the kernel may leave it at any time
+    if (cfg.sockopt.quickack == 1 && c->addr->ai_family != AF_UNIX) {
+        int flags = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &flags, sizeof(flags));
+    }
+#endif
 
     return;
 
@@ -510,6 +1610,596 @@ static void socket_readable(aeEventLoop *loop, int fd, void *data, int mask) {
     reconnect_socket(c->thread, c);
 }
 
+// Run every byte through http_parser, a read of 0 bytes is only expected
+// to end a body that is delimited by the connection closing.
+static int parse_responses(connection *c, char *buf, size_t n) {
+    uint64_t reconnects = c->reconnects;
+    if (http_parser_execute(&c->parser, &parser_settings, buf, n) != n) return -1;
+    if (c->reconnects != reconnects) return 0;
+    return n == 0 && !http_body_is_final(&c->parser) ? -1 : 0;
+}
+
+// Find response boundaries with the framer, running http_parser over any
+// response the framer cannot handle until that response is complete.
+static int frame_responses(connection *c, char *buf, size_t n) {
+    uint64_t reconnects = c->reconnects;
+    char *p = buf, *end = buf + n;
+    framer_result result;
+    size_t used;
+
+    if (n == 0) {
+        if (!c->parsing) return -1;
+        http_parser_execute(&c->parser, &parser_settings, buf, 0);
+        return http_body_is_final(&c->parser) ? 0 : -1;
+    }
+
+    while (p < end && c->reconnects == reconnects) {
+        if (c->parsing) {
+            used = http_parser_execute(&c->parser, &parser_settings, p, end - p);
+            if (HTTP_PARSER_ERRNO(&c->parser) == HPE_PAUSED) {
+                http_parser_pause(&c->parser, 0);
+            } else if (used != (size_t) (end - p)) {
+                return -1;
+            }
+            p += used;
+            continue;
+        }
+
+        p += http_framer_execute(&c->framer, p, end - p, &result);
+        switch (result) {
+            case FRAMER_COMPLETE:
+                message_complete(c, c->framer.status, c->framer.keep_alive);
+                break;
+            case FRAMER_FALLBACK:
+                c->parsing = true;
+                break;
+            case FRAMER_ERROR:
+                return -1;
+            case FRAMER_MORE:
+                break;
+        }
+    }
+
+    return 0;
+}
+
+// Find response boundaries for a non-HTTP protocol. Connections are kept
+// open, and a RESP error reply counts as an error status.
+static int frame_protocol(connection *c, char *buf, size_t n) {
+    uint64_t reconnects = c->reconnects;
+    char *p = buf, *end = buf + n;
+    framing_result result;
+
+    if (n == 0) return -1;
+
+    while (p < end && c->reconnects == reconnects) {
+        p += framing_execute(&cfg.framing, c->framing, p, end - p, &result);
+        switch (result) {
+            case FRAMING_COMPLETE:
+                message_complete(c, c->framing->error ? 500 : 200, true);
+                break;
+            case FRAMING_ERROR:
+                return -1;
+            case FRAMING_MORE:
+                break;
+        }
+    }
+
+    return 0;
+}
+
+static stream *find_stream(connection *c, uint32_t id) {
+    for (uint64_t i = 0; i < cfg.streams; i++) {
+        if (c->h2->streams[i].id == id) return &c->h2->streams[i];
+    }
+    return NULL;
+}
+
+static int stream_status(http2 *session, uint32_t id, int status) {
+    stream *s = find_stream(http2_data(session), id);
+    if (s && !s->status) s->status = status;
+    return 0;
+}
+
+static int stream_header(http2 *session, uint32_t id, const char *name, size_t nlen, const char *value, size_t vlen) {
+    stream *s = find_stream(http2_data(session), id);
+    if (s) {
+        buffer_append(&s->headers, name, nlen);
+        *s->headers.cursor++ = '\0';
+        buffer_append(&s->headers, value, vlen);
+        *s->headers.cursor++ = '\0';
+    }
+    return 0;
+}
+
+static int stream_data(http2 *session, uint32_t id, const char *data, size_t len) {
+    stream *s = find_stream(http2_data(session), id);
+    if (s) {
+        if (cfg.expect.body) expect_body(&cfg.expect, &s->expect, data, len);
+        if (cfg.response) buffer_append(&s->body, data, len);
+    }
+    return 0;
+}
+
+static int stream_delay(aeEventLoop *loop, long long id, void *data) {
+    connection *c = data;
+    c->h2->deferred--;
+    if (!c->h2->ready) return AE_NOMORE;
+
+    if (streams_drained(c)) {
+        reconnect_socket(c->thread, c);
+    } else {
+        submit_streams(c);
+        if (flush_streams(c)) {
+            c->thread->errors.write++;
+            reconnect_socket(c->thread, c);
+        }
+    }
+    return AE_NOMORE;
+}
+
+// Each stream is timed on its own from submission to END_STREAM, so the
+// latency of one response includes any time spent behind others sharing
+// the connection.
+static int stream_close(http2 *session, uint32_t id, uint32_t error) {
+    connection *c = http2_data(session);
+    thread *thread = c->thread;
+    stream *s = find_stream(c, id);
+
+    if (!s) return 0;
+    s->id = 0;
+
+    if (error) {
+        // a refused stream was never processed and is not an error
+        if (error != HTTP2_REFUSED_STREAM) thread->errors.read++;
+        buffer_reset(&s->headers);
+        buffer_reset(&s->body);
+        expect_reset(&s->expect);
+        return 0;
+    }
+
+    uint64_t latency = time_us() - s->start;
+
+    thread->complete++;
+    thread->requests++;
+    c->complete++;
+    c->served++;
+
+    if (s->status > 399) {
+        thread->errors.status++;
+    }
+
+    if (expect_any(&cfg.expect)) {
+        expect_check(&cfg.expect, &s->expect, s->status, &thread->errors);
+    }
+
+    if (!stats_record(statistics.latency, latency)) {
+        thread->errors.timeout++;
+    }
+    c->latency_max = MAX(c->latency_max, latency);
+    if (c->target) target_record(c->target, latency);
+
+    if (cfg.response) {
+        script_response(thread->L, s->status, &s->headers, &s->body);
+    }
+
+    if (cfg.delay) {
+        c->h2->deferred++;
+        aeCreateTimeEvent(thread->loop, script_delay(thread->L), stream_delay, c, NULL);
+    }
+
+    return 0;
+}
+
+// A connection stops opening streams once it has used its stream ids, been
+// sent GOAWAY, reached --requests-per-conn or been moved to a new address
+// set, and is reconnected when the last open stream finishes.
+static bool streams_drained(connection *c) {
+    http2 *session = c->h2->session;
+
+    if (http2_exhausted(session)) return true;
+    if (cfg.requests_per_conn && c->h2->submitted >= cfg.requests_per_conn) return true;
+    return target_moved(c);
+}
+
+static void submit_streams(connection *c) {
+    thread *thread = c->thread;
+    http2 *session = c->h2->session;
+
+    while (http2_active(session) + c->h2->deferred < cfg.streams && http2_can_submit(session)) {
+        if (streams_drained(c)) return;
+
+        if (c->h2->next == c->h2->count) {
+            c->h2->next = 0;
+            if (cfg.dynamic) {
+                http2_requests_free(c->h2->requests, c->h2->count);
+                script_request(thread->L, &c->request);
+                c->h2->requests = http2_convert(c->request.iov, c->request.iovcnt, cfg.ctx ? "https" : "http", &c->h2->count);
+                if (!c->h2->count) {
+                    thread->errors.write++;
+                    return;
+                }
+            }
+        }
+
+        stream *s = find_stream(c, 0);
+        s->id     = http2_submit(session, &c->h2->requests[c->h2->next++]);
+        s->status = 0;
+        s->start  = time_us();
+        c->h2->submitted++;
+    }
+}
+
+// Write out queued frames, registering for writable events only while the
+// socket buffer is full.
+static int flush_streams(connection *c) {
+    aeEventLoop *loop = c->thread->loop;
+    struct iovec iov;
+    size_t n;
+
+    while ((iov = http2_output(c->h2->session)).iov_len) {
+        switch (sock.write(c, &iov, 1, &n)) {
+            case OK:    break;
+            case ERROR: return -1;
+            case RETRY:
+                aeCreateFileEvent(loop, c->fd, AE_WRITABLE, streams_writeable, c);
+                return 0;
+        }
+        http2_consume(c->h2->session, n);
+    }
+
+    if (aeGetFileEvents(loop, c->fd) & AE_WRITABLE) {
+        aeDeleteFileEvent(loop, c->fd, AE_WRITABLE);
+    }
+
+    return 0;
+}
+
+static void streams_writeable(aeEventLoop *loop, int fd, void *data, int mask) {
+    connection *c = data;
+    if (flush_streams(c)) {
+        c->thread->errors.write++;
+        reconnect_socket(c->thread, c);
+    }
+}
+
+static void streams_readable(aeEventLoop *loop, int fd, void *data, int mask) {
+    connection *c = data;
+    thread *thread = c->thread;
+    status status;
+    char *buf;
+    size_t n;
+
+    do {
+        if ((status = sock.read(c, &buf, &n)) != OK) break;
+
+        if (n == 0) {
+            // the server may close an idle connection, e.g. after GOAWAY
+            if (http2_active(c->h2->session)) goto error;
+            reconnect_socket(thread, c);
+            return;
+        }
+
+        thread->bytes += n;
+        c->bytes += n;
+        if (c->target) __sync_fetch_and_add(&c->target->bytes, n);
+
+        if (http2_execute(c->h2->session, buf, n)) goto error;
+    } while (n == thread->bufsize && sock.readable(c) > 0);
+
+    if (status == ERROR) goto error;
+
+    if (!http2_active(c->h2->session) && streams_drained(c)) {
+        reconnect_socket(thread, c);
+        return;
+    }
+
+    submit_streams(c);
+    if (flush_streams(c)) {
+        thread->errors.write++;
+        reconnect_socket(thread, c);
+        return;
+    }
+
+#ifdef TCP_QUICKACK
+    if (cfg.sockopt.quickack == 1 && c->addr->ai_family != AF_UNIX) {
+        int flags = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &flags, sizeof(flags));
+    }
+#endif
+
+    return;
+
+  error:
+    thread->errors.read++;
+    reconnect_socket(thread, c);
+}
+
+// Turn the request into an Upgrade handshake sent on every connection and
+// work out the Sec-WebSocket-Accept value servers must answer with.
+static void ws_handshake(lua_State *L) {
+    buffer *b = &cfg.ws.handshake;
+    request r = { 0 };
+    char key[32], *end;
+
+    script_request(L, &r);
+    for (int i = 0; i < r.iovcnt; i++) {
+        buffer_append(b, r.iov[i].iov_base, r.iov[i].iov_len);
+    }
+    *b->cursor = '\0';
+    script_release(L, r.ref);
+    free(r.iov);
+
+    if (!(end = strstr(b->buffer, "\r\n\r\n")) || end + 4 != b->cursor) {
+        fprintf(stderr, "WebSocket handshake must be a request without a body\n");
+        exit(1);
+    }
+    b->cursor = end + 2;
+
+    websocket_key(key);
+    websocket_accept(key, cfg.ws.accept);
+
+    char *headers = NULL;
+    aprintf(&headers, "Upgrade: websocket\r\n"
+                      "Connection: Upgrade\r\n"
+                      "Sec-WebSocket-Key: %s\r\n"
+                      "Sec-WebSocket-Version: 13\r\n\r\n", key);
+    buffer_append(b, headers, strlen(headers));
+    free(headers);
+}
+
+// Check the handshake response. Returns 0 once upgraded, 1 for any other
+// status and -1 if the response is malformed.
+static int ws_upgraded(connection *c, char *head) {
+    if (strncmp(head, "HTTP/1.", 7) || strlen(head) < 12) return -1;
+    if (strncmp(head + 8, " 101", 4)) {
+        c->thread->errors.status++;
+        return 1;
+    }
+
+    for (char *line = strstr(head, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (!strncasecmp(line, "sec-websocket-accept:", 21)) {
+            char *value = line + 21;
+            while (*value == ' ' || *value == '\t') value++;
+            return strncmp(value, cfg.ws.accept, strlen(cfg.ws.accept)) ? -1 : 0;
+        }
+    }
+
+    return -1;
+}
+
+// Queue a masked frame whose payload is prefix followed by data.
+static void ws_frame(connection *c, uint8_t opcode, const char *prefix, size_t plen, const char *data, size_t len) {
+    buffer *b = &c->ws->out;
+    unsigned int *seed = &c->thread->seed;
+    uint32_t mask = (uint32_t) rand_r(seed) << 16 ^ rand_r(seed);
+    uint8_t header[WEBSOCKET_HEADER];
+
+    size_t n = websocket_header(header, opcode, plen + len, mask);
+    buffer_append(b, (char *) header, n);
+    size_t offset = b->cursor - b->buffer;
+    buffer_append(b, prefix, plen);
+    buffer_append(b, data, len);
+    websocket_mask(b->buffer + offset, plen + len, mask);
+}
+
+// Each message starts with a sequence number and its send time, which an
+// echo server returns unchanged for the round trip to be measured.
+static void ws_message(connection *c, uint64_t now) {
+    thread *thread = c->thread;
+    uint64_t stamp[2] = { c->ws->seq++, now };
+    char *data = cfg.ws.message;
+    size_t len = strlen(data);
+
+    if (cfg.ws.script) {
+        buffer_reset(&thread->message);
+        script_message(thread->L, &thread->message);
+        data = thread->message.buffer;
+        len  = thread->message.cursor - thread->message.buffer;
+    }
+
+    ws_frame(c, WEBSOCKET_BINARY, (char *) stamp, sizeof(stamp), data, len);
+    c->start = now;
+    c->ws->sent++;
+    c->ws->waiting = true;
+}
+
+// Queue the messages due by now. At a fixed rate nothing is added while
+// earlier frames are still waiting to be written, any messages missed are
+// then sent together once the socket drains.
+static void ws_schedule(connection *c, uint64_t now) {
+    if (!cfg.ws.rate) {
+        if (!c->ws->waiting) ws_message(c, now);
+        return;
+    }
+
+    if (c->ws->out.cursor != c->ws->out.buffer) return;
+
+    uint64_t due = (now - c->ws->opened) * cfg.ws.rate / 1000000 + 1;
+    while (c->ws->sent < due) ws_message(c, now);
+}
+
+static int ws_interval() {
+    return MAX(MIN(1000 / cfg.ws.rate, WS_TICK_MAX_MS), 1);
+}
+
+static int ws_tick(aeEventLoop *loop, long long id, void *data) {
+    thread *thread = data;
+    uint64_t now = time_us();
+
+    for (uint64_t i = 0; i < thread->connections; i++) {
+        connection *c = &thread->cs[i];
+        if (!c->ws->open) continue;
+        ws_schedule(c, now);
+        if (ws_flush(c)) {
+            thread->errors.write++;
+            reconnect_socket(thread, c);
+        }
+    }
+
+    return ws_interval();
+}
+
+// A stamp is only trusted if it names a message sent on this connection
+// since it was opened.
+static bool ws_stamp(connection *c, websocket_parser *p, uint64_t *sent) {
+    uint64_t stamp[2];
+
+    if (p->payload_len < sizeof(stamp)) return false;
+    memcpy(stamp, p->payload, sizeof(stamp));
+    if (stamp[0] >= c->ws->seq || stamp[1] < c->ws->opened || stamp[1] > time_us()) return false;
+
+    *sent = stamp[1];
+    return true;
+}
+
+// Called as each frame ends. Returns 1 once the server has started a close,
+// after queuing the reply. One message in flight is timed from when it was
+// sent if the reply carries no stamp, e.g. when the server does not echo.
+static int ws_received(websocket_parser *p) {
+    connection *c = p->data;
+    thread *thread = c->thread;
+    uint64_t sent, now;
+
+    switch (p->opcode) {
+        case WEBSOCKET_PING:
+            ws_frame(c, WEBSOCKET_PONG, p->payload, p->payload_len, "", 0);
+            return 0;
+        case WEBSOCKET_PONG:
+            return 0;
+        case WEBSOCKET_CLOSE:
+            ws_frame(c, WEBSOCKET_CLOSE, p->payload, MIN(p->payload_len, 2), "", 0);
+            return 1;
+        case WEBSOCKET_TEXT:
+        case WEBSOCKET_BINARY:
+            c->ws->stamp = ws_stamp(c, p, &sent) ? sent : 0;
+            break;
+    }
+
+    if (!p->fin) return 0;
+
+    thread->complete++;
+    thread->requests++;
+    c->complete++;
+
+    now  = time_us();
+    sent = c->ws->stamp;
+    if (!sent && c->ws->waiting && !cfg.ws.rate) sent = c->start;
+    c->ws->waiting = false;
+
+    if (sent) {
+        uint64_t latency = now - sent;
+        if (!stats_record(statistics.latency, latency)) {
+            thread->errors.timeout++;
+        }
+        c->latency_max = MAX(c->latency_max, latency);
+        if (c->target) target_record(c->target, latency);
+    }
+
+    if (!cfg.ws.rate) ws_schedule(c, now);
+    return 0;
+}
+
+static int ws_receive(connection *c, char *data, size_t n) {
+    char *end;
+
+    if (c->ws->open) return websocket_execute(&c->ws->parser, data, n, ws_received);
+
+    buffer_append(&c->ws->in, data, n);
+    *c->ws->in.cursor = '\0';
+    if (!(end = strstr(c->ws->in.buffer, "\r\n\r\n"))) return 0;
+
+    *end = '\0';
+    int rc = ws_upgraded(c, c->ws->in.buffer);
+    if (rc) return rc;
+
+    c->ws->open   = true;
+    c->ws->opened = time_us();
+    c->ws->seq    = 0;
+    c->ws->sent   = 0;
+    ws_schedule(c, c->ws->opened);
+
+    end += 4;
+    n = c->ws->in.cursor - end;
+    buffer_reset(&c->ws->in);
+    return websocket_execute(&c->ws->parser, end, n, ws_received);
+}
+
+static int ws_flush(connection *c) {
+    aeEventLoop *loop = c->thread->loop;
+    buffer *b = &c->ws->out;
+    struct iovec iov;
+    size_t n;
+
+    while (c->ws->written < (size_t) (b->cursor - b->buffer)) {
+        iov.iov_base = b->buffer + c->ws->written;
+        iov.iov_len  = b->cursor - b->buffer - c->ws->written;
+        switch (sock.write(c, &iov, 1, &n)) {
+            case OK:    break;
+            case ERROR: return -1;
+            case RETRY:
+                aeCreateFileEvent(loop, c->fd, AE_WRITABLE, ws_writeable, c);
+                return 0;
+        }
+        c->ws->written += n;
+    }
+
+    buffer_reset(b);
+    c->ws->written = 0;
+
+    if (aeGetFileEvents(loop, c->fd) & AE_WRITABLE) {
+        aeDeleteFileEvent(loop, c->fd, AE_WRITABLE);
+    }
+
+    return 0;
+}
+
+static void ws_writeable(aeEventLoop *loop, int fd, void *data, int mask) {
+    connection *c = data;
+    if (ws_flush(c)) {
+        c->thread->errors.write++;
+        reconnect_socket(c->thread, c);
+    }
+}
+
+static void ws_readable(aeEventLoop *loop, int fd, void *data, int mask) {
+    connection *c = data;
+    thread *thread = c->thread;
+    status status;
+    char *buf;
+    size_t n;
+    int rc = 0;
+
+    do {
+        if ((status = sock.read(c, &buf, &n)) != OK) break;
+        if (n == 0) goto error;
+
+        thread->bytes += n;
+        c->bytes += n;
+        if (c->target) __sync_fetch_and_add(&c->target->bytes, n);
+
+        if ((rc = ws_receive(c, buf, n))) break;
+    } while (n == thread->bufsize && sock.readable(c) > 0);
+
+    if (status == ERROR || rc < 0) goto error;
+
+    if (ws_flush(c)) {
+        thread->errors.write++;
+        reconnect_socket(thread, c);
+        return;
+    }
+
+    // the server refused the upgrade or is closing the connection
+    if (rc > 0) reconnect_socket(thread, c);
+
+    return;
+
+  error:
+    thread->errors.read++;
+    reconnect_socket(thread, c);
+}
+
 static uint64_t time_us() {
     struct timeval t;
     gettimeofday(&t, NULL);
@@ -529,6 +2219,81 @@ static char *copy_url_part(char *url, struct http_parser_url *parts, enum http_p
     return part;
 }
 
+// Parse a single IPv4 or IPv6 address, or an inclusive range A-B where
+// both ends differ only in their low 32 bits.
+static int parse_source_addrs(struct config *cfg, char *arg) {
+    struct sockaddr_storage *ss = &cfg->source.addr;
+    char *last = strchr(arg, '-');
+    uint8_t first[16], end[16];
+    int family = strchr(arg, ':') ? AF_INET6 : AF_INET;
+    size_t size = family == AF_INET ? 4 : 16;
+
+    if (last) *last = '\0';
+    int rc = inet_pton(family, arg, first);
+    if (last) *last++ = '-';
+
+    if (rc != 1 || inet_pton(family, last ? last : arg, end) != 1) return -1;
+    if (memcmp(first, end, size - 4)) return -1;
+
+    uint32_t a, b;
+    memcpy(&a, &first[size - 4], 4);
+    memcpy(&b, &end[size - 4], 4);
+    if (ntohl(b) < ntohl(a)) return -1;
+    if (ntohl(b) - ntohl(a) == UINT32_MAX) return -1;
+
+    memset(ss, 0, sizeof(*ss));
+    if (family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, first, size);
+        cfg->source.len = sizeof(*sin);
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, first, size);
+        cfg->source.len = sizeof(*sin6);
+    }
+    cfg->source.count = ntohl(b) - ntohl(a) + 1;
+
+    return 0;
+}
+
+// Only the http+unix and https+unix schemes name a unix socket, a +unix://
+// elsewhere in the URL is an ordinary part of its path or query.
+static bool is_unix_url(char *url) {
+    return !strncasecmp(url, "http+unix://", 12) || !strncasecmp(url, "https+unix://", 13);
+}
+
+// Rewrite http+unix://%2Frun%2Fapp.sock/path as http://localhost/path and
+// remember the decoded socket path, which is resolved in place of the host.
+static char *parse_unix_url(struct config *cfg, char *url) {
+    char *plus = strchr(url, '+');
+    char *host = plus + 8;
+    char *end  = host + strcspn(host, "/?#");
+    char *path = zcalloc(end - host + 1), *p = path;
+    struct sockaddr_un sun;
+
+    for (char *s = host; s < end; s++) {
+        if (s[0] == '%' && isxdigit(s[1]) && isxdigit(s[2])) {
+            char hex[3] = { s[1], s[2], '\0' };
+            *p++ = (char) strtol(hex, NULL, 16);
+            s += 2;
+        } else {
+            *p++ = *s;
+        }
+    }
+
+    if (*path != '/' || p - path >= (ssize_t) sizeof(sun.sun_path)) {
+        zfree(path);
+        return NULL;
+    }
+
+    char *rewritten = NULL;
+    cfg->socket = path;
+    aprintf(&rewritten, "%.*s://localhost%s", (int) (plus - url), url, end);
+    return rewritten;
+}
+
 //长选项 和短选项的对应关系
 static struct option longopts[] = {
     { "connections", required_argument, NULL, 'c' },
@@ -537,7 +2302,47 @@ static struct option longopts[] = {
     { "script",      required_argument, NULL, 's' },
     { "header",      required_argument, NULL, 'H' },
     { "latency",     no_argument,       NULL, 'L' },
+    { "conn-stats",  no_argument,       NULL, 'C' },
     { "timeout",     required_argument, NULL, 'T' },
+    { "busy-poll",   no_argument,       NULL, 'B' },
+    { "zerocopy",    no_argument,       NULL, 'Z' },
+    { "source-addrs", required_argument, NULL, 'A' },
+    { "requests-per-conn", required_argument, NULL, 'N' },
+    { "rst-close",   no_argument,       NULL, 'R' },
+    { "tcp-fastopen", no_argument,      NULL, 'F' },
+    { "recv-buf",    required_argument, NULL, 'U' },
+    { "timestamps",  no_argument,       NULL, 'K' },
+    { "balance",     required_argument, NULL, 'D' },
+    { "resolve-interval", required_argument, NULL, 'E' },
+    { "rcvbuf",      required_argument, NULL, 'I' },
+    { "sndbuf",      required_argument, NULL, 'O' },
+    { "quickack",    no_argument,       NULL, 'Q' },
+    { "notsent-lowat", required_argument, NULL, 'W' },
+    { "congestion",  required_argument, NULL, 'G' },
+    { "maxseg",      required_argument, NULL, 'M' },
+    { "tos",         required_argument, NULL, 'P' },
+    { "pipeline",    required_argument, NULL, 'X' },
+    { "pipeline-refill", no_argument,   NULL, 'Y' },
+    { "h2",          no_argument,       NULL, '2' },
+    { "no-tls-resume", no_argument,     NULL, 'n' },
+    { "handshake",   no_argument,       NULL, 'k' },
+    { "tls-version", required_argument, NULL, 'j' },
+    { "ciphers",     required_argument, NULL, 'e' },
+    { "ciphersuites", required_argument, NULL, 'f' },
+    { "groups",      required_argument, NULL, 'g' },
+    { "sigalgs",     required_argument, NULL, 'i' },
+    { "expect-status", required_argument, NULL, '3' },
+    { "expect-length", required_argument, NULL, '4' },
+    { "expect-crc32", required_argument, NULL, '5' },
+    { "expect-body", required_argument, NULL, '6' },
+    { "expect-regex", required_argument, NULL, '7' },
+    { "streams",     required_argument, NULL, 'S' },
+    { "websocket",   no_argument,       NULL, 'J' },
+    { "ws-rate",     required_argument, NULL, 'V' },
+    { "ws-message",  required_argument, NULL, '8' },
+    { "framing",     required_argument, NULL, '1' },
+    { "events",      required_argument, NULL, '9' },
+    { "event-time",  required_argument, NULL, '0' },
     { "help",        no_argument,       NULL, 'h' },
     { "version",     no_argument,       NULL, 'v' },
     { NULL,          0,                 NULL,  0  }
@@ -547,6 +2352,8 @@ static struct option longopts[] = {
 // 解析wrk的参数
 static int parse_args(struct config *cfg, char **url, struct http_parser_url *parts, char **headers, int argc, char **argv) {
     char **header = headers;
+    uint64_t n;
+    char *end;
     int c;
 
 // 初始化cfg 指针
@@ -557,6 +2364,12 @@ static int parse_args(struct config *cfg, char **url, struct http_parser_url *pa
     cfg->connections = 10;
     cfg->duration    = 10;
     cfg->timeout     = SOCKET_TIMEOUT_MS;
+    cfg->recv_buf    = RECVBUF;
+    cfg->streams     = 1;
+    cfg->depth       = 1;
+    cfg->ws.message  = "";
+    expect_init(&cfg->expect);
+    cfg->sockopt     = (sockopts) { -1, -1, -1, -1, -1, -1, NULL };
 
     while ((c = getopt_long(argc, argv, "t:c:d:s:H:T:Lrv?", longopts, NULL)) != -1) {
         switch (c) {
@@ -578,6 +2391,154 @@ static int parse_args(struct config *cfg, char **url, struct http_parser_url *pa
             case 'L':
                 cfg->latency = true;
                 break;
+            case 'C':
+                cfg->conn_stats = true;
+                break;
+            case 'B':
+                cfg->busy_poll = true;
+                break;
+            case 'Z':
+                cfg->zerocopy = true;
+                break;
+            case 'N':
+                if (scan_metric(optarg, &cfg->requests_per_conn)) return -1;
+                if (!cfg->requests_per_conn) return -1;
+                break;
+            case 'U':
+                if (scan_metric(optarg, &cfg->recv_buf)) return -1;
+                if (!cfg->recv_buf) return -1;
+                break;
+            case 'K':
+                cfg->timestamps = true;
+                break;
+            case 'D':
+                if      (!strcmp(optarg, "rr"))       cfg->balance = BALANCE_RR;
+                else if (!strcmp(optarg, "random"))   cfg->balance = BALANCE_RANDOM;
+                else if (!strcmp(optarg, "weighted")) cfg->balance = BALANCE_WEIGHTED;
+                else return -1;
+                break;
+            case 'E':
+                if (scan_time(optarg, &cfg->resolve_interval)) return -1;
+                if (!cfg->resolve_interval) return -1;
+                break;
+            case 'I':
+                if (scan_metric(optarg, &n) || n > INT_MAX) return -1;
+                cfg->sockopt.rcvbuf = n;
+                break;
+            case 'O':
+                if (scan_metric(optarg, &n) || n > INT_MAX) return -1;
+                cfg->sockopt.sndbuf = n;
+                break;
+            case 'Q':
+                cfg->sockopt.quickack = 1;
+                break;
+            case 'W':
+                if (scan_metric(optarg, &n) || n > INT_MAX) return -1;
+                cfg->sockopt.notsent_lowat = n;
+                break;
+            case 'G':
+                cfg->sockopt.congestion = optarg;
+                break;
+            case 'M':
+                if (scan_metric(optarg, &n) || n > INT_MAX) return -1;
+                cfg->sockopt.maxseg = n;
+                break;
+            case 'P':
+                cfg->sockopt.tos = strtol(optarg, &end, 0);
+                if (*end || cfg->sockopt.tos < 0 || cfg->sockopt.tos > 255) return -1;
+                break;
+            case 'X':
+                if (scan_metric(optarg, &cfg->depth)) return -1;
+                if (!cfg->depth) return -1;
+                break;
+            case 'Y':
+                cfg->refill = true;
+                break;
+            case '2':
+                cfg->h2 = true;
+                break;
+            case 'n':
+                cfg->no_resume = true;
+                break;
+            case 'k':
+                cfg->handshake = true;
+                break;
+            case 'j':
+                if      (!strcmp(optarg, "1.2")) cfg->tls_version = TLS1_2_VERSION;
+                else if (!strcmp(optarg, "1.3")) cfg->tls_version = TLS1_3_VERSION;
+                else return -1;
+                break;
+            case 'e':
+                cfg->ciphers = optarg;
+                break;
+            case 'f':
+                cfg->ciphersuites = optarg;
+                break;
+            case 'g':
+                cfg->groups = optarg;
+                break;
+            case 'i':
+                cfg->sigalgs = optarg;
+                break;
+            case 'S':
+                if (scan_metric(optarg, &cfg->streams)) return -1;
+                if (!cfg->streams || cfg->streams > INT_MAX) return -1;
+                break;
+            case 'J':
+                cfg->websocket = true;
+                break;
+            case 'V':
+                if (scan_metric(optarg, &cfg->ws.rate)) return -1;
+                if (!cfg->ws.rate) return -1;
+                break;
+            case '8':
+                cfg->ws.message = optarg;
+                break;
+            case '1':
+                if (framing_parse(&cfg->framing, optarg)) {
+                    fprintf(stderr, "invalid framing: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case '9':
+                if (events_parse_mode(&cfg->events, optarg)) return -1;
+                break;
+            case '0':
+                events_parse_field(&cfg->events, optarg);
+                break;
+            case '3':
+                if (expect_parse_status(&cfg->expect, optarg)) {
+                    fprintf(stderr, "invalid status list: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case '4':
+                if (expect_parse_length(&cfg->expect, optarg)) return -1;
+                break;
+            case '5':
+                if (expect_parse_crc32(&cfg->expect, optarg)) return -1;
+                break;
+            case '6':
+                if (expect_parse_body(&cfg->expect, optarg)) return -1;
+                break;
+            case '7':
+                if (expect_parse_regex(&cfg->expect, optarg)) {
+                    fprintf(stderr, "invalid regex: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'R':
+                cfg->rst_close = true;
+                break;
+            case 'F':
+                cfg->fastopen = true;
+                break;
+            case 'A':
+                if (parse_source_addrs(cfg, optarg)) {
+                    fprintf(stderr, "invalid source address: %s\n", optarg);
+                    return -1;
+                }
+                break;
             case 'T':
                 if (scan_time(optarg, &cfg->timeout)) return -1;
                 cfg->timeout *= 1000;
@@ -597,10 +2558,23 @@ static int parse_args(struct config *cfg, char **url, struct http_parser_url *pa
 
     if (optind == argc || !cfg->threads || !cfg->duration) return -1;
 
+    if (cfg->resolve_interval && !cfg->balance) cfg->balance = BALANCE_RR;
+
+    if (cfg->h2 && (cfg->depth > 1 || cfg->refill)) {
+        fprintf(stderr, "--pipeline cannot be used with --h2, use --streams\n");
+        return -1;
+    }
+
 // 找到url对应的值 argv[optind]
 //解析url中的各种 参数
 
-    if (!script_parse_url(argv[optind], parts)) {
+    *url = argv[optind];
+    if (is_unix_url(*url) && !(*url = parse_unix_url(cfg, *url))) {
+        fprintf(stderr, "invalid unix socket URL: %s\n", argv[optind]);
+        return -1;
+    }
+
+    if (!script_parse_url(*url, parts)) {
         fprintf(stderr, "invalid URL: %s\n", argv[optind]);
         return -1;
     }
@@ -611,7 +2585,6 @@ static int parse_args(struct config *cfg, char **url, struct http_parser_url *pa
         return -1;
     }
 
-    *url    = argv[optind];
     *header = NULL;
 
     return 0;
@@ -646,9 +2619,9 @@ static void print_stats(char *name, stats *stats, char *(*fmt)(long double)) {
     printf("%8.2Lf%%\n", stats_within_stdev(stats, mean, stdev, 1));
 }
 
-static void print_stats_latency(stats *stats) {
+static void print_stats_latency(char *name, stats *stats) {
     long double percentiles[] = { 50.0, 75.0, 90.0, 99.0 };
-    printf("  Latency Distribution\n");
+    printf("  %s Distribution\n", name);
     for (size_t i = 0; i < sizeof(percentiles) / sizeof(long double); i++) {
         long double p = percentiles[i];
         uint64_t n = stats_percentile(stats, p);
@@ -657,3 +2630,152 @@ static void print_stats_latency(stats *stats) {
         printf("\n");
     }
 }
+
+static void print_stats_jitter(stats *stats) {
+    long double percentiles[] = { 50.0, 99.0, 99.99 };
+    printf("  Poll Jitter Floor\n");
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(long double); i++) {
+        long double p = percentiles[i];
+        uint64_t n = stats_percentile(stats, p);
+        printf("%7.2Lf%%", p);
+        print_units(n, format_time_us, 10);
+        printf("\n");
+    }
+    printf("%8s", "Max");
+    print_units(stats->max, format_time_us, 10);
+    printf("\n");
+}
+
+static void print_stats_targets(long double runtime_s) {
+    bool removed = false;
+    printf("  Address Stats%23s%10s%10s%10s%10s\n", "Conns", "Req/Sec", "Transfer", "Avg", "Max");
+    for (target *t = targets.all; t; t = t->next) {
+        uint64_t avg = t->complete ? t->latency / t->complete : 0;
+        printf("    %-27s%c%6"PRIu64, t->name, t->active ? ' ' : '*', t->connections);
+        print_units(t->complete / runtime_s, format_metric, 10);
+        print_units(t->bytes / runtime_s, format_binary, 10);
+        print_units(avg, format_time_us, 10);
+        print_units(t->latency_max, format_time_us, 10);
+        printf("\n");
+        removed |= !t->active;
+    }
+    if (removed) printf("    * no longer resolved\n");
+}
+
+static void print_mismatches(errors *errors) {
+    expect *e = &cfg.expect;
+    printf("  Unexpected responses:");
+    if (e->any_status)     printf(" status %d", errors->mismatch.status);
+    if (e->length >= 0)    printf(" length %d", errors->mismatch.length);
+    if (e->any_crc32)      printf(" crc32 %d",  errors->mismatch.crc32);
+    if (e->prefix)         printf(" body %d",   errors->mismatch.body);
+    printf("\n");
+}
+
+static bool sockopts_set(sockopts *o) {
+    return o->rcvbuf != -1 || o->sndbuf != -1 || o->quickack != -1 ||
+           o->notsent_lowat != -1 || o->maxseg != -1 || o->tos != -1 ||
+           o->congestion;
+}
+
+static void print_sockopts(sockopts *o) {
+    printf("  Socket Options\n");
+    printf("    %-14s%sB\n", "rcvbuf", format_binary(o->rcvbuf));
+    printf("    %-14s%sB\n", "sndbuf", format_binary(o->sndbuf));
+    if (effective.family == AF_UNIX) return;
+
+    if (o->notsent_lowat > 0) {
+        printf("    %-14s%sB\n", "notsent_lowat", format_binary(o->notsent_lowat));
+    } else {
+        printf("    %-14s%s\n", "notsent_lowat", "unlimited");
+    }
+    printf("    %-14s%d\n", "maxseg", o->maxseg);
+    printf("    %-14s0x%02x\n", "tos", o->tos);
+    printf("    %-14s%s\n", "congestion", o->congestion ? o->congestion : "unknown");
+    printf("    %-14s%s\n", "quickack", cfg.sockopt.quickack == 1 ? "on" : "off");
+}
+
+static long double jain_index(long double sum, long double squares, uint64_t n) {
+    return squares > 0 ? (sum * sum) / (n * squares) : 1.0;
+}
+
+// The connection and the state of the features it uses. Its share of the
+// event loop and the receive buffers is counted per thread.
+static size_t connection_memory(connection *c) {
+    size_t size = sizeof(connection) + c->headers.length + c->body.length;
+
+    if (cfg.dynamic)  size += c->request.iovcnt * sizeof(struct iovec);
+    if (c->sent)      size += sizeof(sent_state) + cfg.inflight * sizeof(uint64_t);
+    if (c->framing)   size += sizeof(framing_state);
+    if (c->zerocopy)  size += sizeof(zerocopy_state) + c->zerocopy->size * sizeof(struct held);
+    if (c->timestamp) size += sizeof(timestamp_state);
+    if (c->expect)    size += sizeof(expect_state);
+    if (c->event)     size += sizeof(event_state);
+    if (c->ws)        size += sizeof(ws_state) + c->ws->in.length + c->ws->out.length;
+    if (c->h2) {
+        size += sizeof(h2_state) + http2_memory(c->h2->session);
+        for (uint64_t i = 0; i < cfg.streams; i++) {
+            stream *s = &c->h2->streams[i];
+            size += sizeof(stream) + s->headers.length + s->body.length;
+        }
+    }
+    return size;
+}
+
+static void print_stats_connections(thread *threads) {
+    connection *slowest[SLOWEST_CONNECTIONS] = { NULL };
+    uint64_t min[2] = { UINT64_MAX, UINT64_MAX }, max[2] = { 0, 0 };
+    long double sum[2] = { 0, 0 }, squares[2] = { 0, 0 };
+    uint64_t reconnects = 0, memory = 0, n = 0;
+
+    for (uint64_t i = 0; i < cfg.threads; i++) {
+        thread *t = &threads[i];
+        memory += t->memory;
+        for (uint64_t j = 0; j < t->connections; j++, n++) {
+            connection *c = &t->cs[j];
+            uint64_t v[2] = { c->complete, c->bytes };
+
+            memory += connection_memory(c);
+
+            for (int k = 0; k < 2; k++) {
+                min[k] = MIN(min[k], v[k]);
+                max[k] = MAX(max[k], v[k]);
+                sum[k]     += v[k];
+                squares[k] += (long double) v[k] * v[k];
+            }
+            reconnects += c->reconnects;
+
+            for (int k = 0; k < SLOWEST_CONNECTIONS; k++) {
+                if (!slowest[k] || c->latency_max > slowest[k]->latency_max) {
+                    memmove(&slowest[k + 1], &slowest[k], (SLOWEST_CONNECTIONS - k - 1) * sizeof(connection *));
+                    slowest[k] = c;
+                    break;
+                }
+            }
+        }
+    }
+
+    printf("  Connection Stats%6s%10s%10s\n", "Min", "Max", "Fairness");
+    printf("    %-12s", "Requests");
+    print_units(min[0], format_metric, 8);
+    print_units(max[0], format_metric, 10);
+    printf("%10.4Lf\n", jain_index(sum[0], squares[0], n));
+    printf("    %-12s", "Bytes");
+    print_units(min[1], format_binary, 8);
+    print_units(max[1], format_binary, 10);
+    printf("%10.4Lf\n", jain_index(sum[1], squares[1], n));
+    printf("    %-12s%8"PRIu64"\n", "Reconnects", reconnects);
+    printf("    %-12s%7sB per connection, excluding kernel, TLS and Lua state\n", "Memory", format_binary(memory / n));
+
+    printf("  Slowest Connections%7s%10s%12s\n", "Max", "Requests", "Reconnects");
+    for (int k = 0; k < SLOWEST_CONNECTIONS && slowest[k]; k++) {
+        connection *c = slowest[k];
+        thread *t = c->thread;
+        uint64_t id = c - t->cs;
+        for (thread *p = threads; p < t; p++) id += p->connections;
+        printf("    #%-10"PRIu64"  ", id);
+        print_units(c->latency_max, format_time_us, 11);
+        print_units(c->complete, format_metric, 10);
+        printf("%12"PRIu64"\n", c->reconnects);
+    }
+}
@@ -50,6 +50,8 @@ netdb.h - definitions for network database operations
 #include <sys/socket.h>
 //sys/socket.h - main sockets header
 
+#include <sys/uio.h>
+
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -61,6 +63,12 @@ netdb.h - definitions for network database operations
 
 
 #include "http_parser.h"
+#include "http2.h"
+#include "http_framer.h"
+#include "expect.h"
+#include "websocket.h"
+#include "events.h"
+#include "framing.h"
 
 
 //接收buffer 8192byte
@@ -69,10 +77,48 @@ netdb.h - definitions for network database operations
 
 #define MAX_THREAD_RATE_S   10000000
 #define SOCKET_TIMEOUT_MS   2000
+#define PROBE_TIMEOUT_MS    2000
 #define RECORD_INTERVAL_MS  100
+#define PORT_RETRY_MS       10
+#define SLOWEST_CONNECTIONS 5
+#define MAX_POLL_JITTER_US  100000
+#define BUSY_POLL_US        50
+#define MAX_REQUEST_IOV     64
+#define ZEROCOPY_MIN        16384
+#define RING_BUFFERS_MAX    4096
+#define RING_DISCARD_MIN    65536
+#define WS_TICK_MAX_MS      100
 
 extern const char *VERSION;
 
+typedef struct {
+    char  *buffer;
+    size_t length;
+    char  *cursor;
+} buffer;
+
+typedef struct target {
+    struct addrinfo addr;
+    char *name;
+    uint32_t weight;
+    bool active;
+    uint64_t connections;
+    uint64_t complete;
+    uint64_t bytes;
+    uint64_t latency;
+    uint64_t latency_max;
+    struct target *next;
+} target;
+
+typedef struct target_set {
+    uint64_t version;
+    uint64_t next;
+    uint64_t weight;
+    size_t count;
+    target **targets;
+    struct target_set *prev;
+} target_set;
+
 typedef struct {
     pthread_t thread;
     aeEventLoop *loop;
@@ -80,40 +126,146 @@ typedef struct {
     uint64_t connections;
     uint64_t complete;
     uint64_t requests;
+    uint64_t connects;
     uint64_t bytes;
+    uint64_t events;
+    uint64_t handshakes;
+    uint64_t resumed;
     uint64_t start;
     lua_State *L;
     errors errors;
+    stats *jitter;
+    char *buf;
+    size_t bufsize;
+    size_t memory;
+    unsigned int seed;
     struct connection *cs;
+    buffer message;
 } thread;
 //  线程结构体
 
 
 typedef struct {
-    char  *buffer;
+    int rcvbuf;
+    int sndbuf;
+    int quickack;
+    int notsent_lowat;
+    int maxseg;
+    int tos;
+    char *congestion;
+} sockopts;
+
+typedef struct {
+    struct iovec *iov;
+    int iovcnt;
     size_t length;
-    char  *cursor;
-} buffer;
+    int ref;
+} request;
 // buffer结构体
 
 
+typedef struct {
+    uint32_t id;
+    int status;
+    uint64_t start;
+    buffer headers;
+    buffer body;
+    expect_state expect;
+} stream;
+
+// State of features that are off by default. A connection only points to
+// it when the feature is in use.
+typedef struct {
+    bool enabled;
+    uint32_t sent;
+    uint32_t done;
+    struct held {
+        int ref;
+        uint32_t seq;
+    } *held;
+    uint32_t count;
+    uint32_t size;
+} zerocopy_state;
+
+typedef struct {
+    bool enabled;
+    bool tx_hardware;
+    bool rx_hardware;
+    uint64_t tx;
+    uint64_t rx;
+} timestamp_state;
+
+typedef struct {
+    http2 *session;
+    http2_request *requests;
+    size_t count;
+    size_t next;
+    stream *streams;
+    uint64_t submitted;
+    uint64_t deferred;
+    bool ready;
+} h2_state;
+
+typedef struct {
+    websocket_parser parser;
+    buffer in;
+    buffer out;
+    size_t written;
+    bool open;
+    bool waiting;
+    uint64_t opened;
+    uint64_t seq;
+    uint64_t sent;
+    uint64_t stamp;
+} ws_state;
+
+// Send times of pipelined requests, only needed with more than one in flight.
+typedef struct {
+    uint64_t head;
+    uint64_t tail;
+    uint64_t times[];
+} sent_state;
+
 typedef struct connection {
     thread *thread;
+    struct addrinfo *addr;
+    target *target;
+    uint64_t version;
+    bool moving;
     http_parser parser;
+    http_framer framer;
+    bool parsing;
     enum {
         FIELD, VALUE
     } state;
     int fd;
+    bool ring;
     SSL *ssl;
+    SSL_SESSION *session;
+    bool ticketed;
+    uint64_t deadline;
     bool delayed;
     uint64_t start;
-    char *request;
-    size_t length;
+    uint64_t connect_start;
+    request request;
     size_t written;
+    uint64_t queued;
     uint64_t pending;
+    uint64_t served;
+    uint64_t complete;
+    uint64_t bytes;
+    uint64_t reconnects;
+    uint64_t latency_max;
     buffer headers;
     buffer body;
-    char buf[RECVBUF];
+    sent_state *sent;
+    framing_state *framing;
+    zerocopy_state *zerocopy;
+    timestamp_state *timestamp;
+    h2_state *h2;
+    ws_state *ws;
+    expect_state *expect;
+    event_state *event;
 } connection;
 //连接结构体
 
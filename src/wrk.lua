@@ -11,8 +11,13 @@ local wrk = {
 
 function wrk.resolve(host, service)
    local addrs = wrk.lookup(host, service)
+   local times = wrk.probe(addrs)
+   wrk.probes  = {}
+   for i = 1, #addrs do
+      wrk.probes[i] = { addr = addrs[i], time = times[i] }
+   end
    for i = #addrs, 1, -1 do
-      if not wrk.connect(addrs[i]) then
+      if not times[i] then
          table.remove(addrs, i)
       end
    end
@@ -47,7 +52,7 @@ function wrk.init(args)
    end
 end
 
-function wrk.format(method, path, headers, body)
+function wrk.format(method, path, headers, body, length)
    local method  = method  or wrk.method
    local path    = path    or wrk.path
    local headers = headers or wrk.headers
@@ -58,7 +63,13 @@ function wrk.format(method, path, headers, body)
       headers["Host"] = wrk.headers["Host"]
    end
 
-   headers["Content-Length"] = body and string.len(body)
+   if length then
+      headers["Content-Length"] = length
+      body = nil
+   else
+      body = body and tostring(body)
+      headers["Content-Length"] = body and string.len(body)
+   end
 
    s[1] = string.format("%s %s HTTP/1.1", method, path)
    for name, value in pairs(headers) do